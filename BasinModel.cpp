@@ -13,21 +13,38 @@
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
+#include <cmath>
+#include <algorithm>
 
 // paramsStruct
 paramsStruct::paramsStruct() : nfields(0) {}
 
+// fieldNames is rebuilt on copy, so that it points into the copy's own keys
+paramsStruct::paramsStruct(const paramsStruct& other) : nfields(other.nfields), fields(other.fields) {
+    update_field_names();
+}
+
+paramsStruct& paramsStruct::operator=(const paramsStruct& other) {
+    nfields = other.nfields;
+    fields = other.fields;
+    update_field_names();
+    return *this;
+}
+
 int paramsStruct::get_nfields() {return nfields;}
 
-void paramsStruct::addField(string name, myMatrix<double>& value) {
+void paramsStruct::addField(string name, myMatrix<stat_t>& value) {
     nfields++;
     fields[name] = &value;
-    
+    update_field_names();
+    return;
+}
+
+void paramsStruct::update_field_names() {
     fieldNames.clear();
-    for (map<string, myMatrix<double>* >::iterator it = fields.begin(); it!=fields.end(); ++it) {
+    for (map<string, myMatrix<stat_t>* >::iterator it = fields.begin(); it!=fields.end(); ++it) {
         fieldNames.push_back((it->first).data());
     }
-    
     return;
 }
 
@@ -35,7 +52,7 @@ const char** paramsStruct::fieldNamesArray() {
     return fieldNames.data();
 }
 
-vector<double>* paramsStruct::getFieldData(int index) {
+vector<stat_t>* paramsStruct::getFieldData(int index) {
     return fields[fieldNames[index]]->data();
 }
 
@@ -70,9 +87,7 @@ const char* paramsStruct::getFieldName(int index) {
 // BasinModel
 void BasinModel::reset_stats() {
     norm = 0;
-    for (vector<double>::iterator it=stats.begin(); it!=stats.end(); ++it) {
-        *it = 0;
-    }
+    stats_acc.assign(stats.size(), 0);
     return;
 }
 
@@ -81,15 +96,18 @@ void BasinModel::increment_stats(const State& this_state) {
     double wt = this_state.weight[basin_num];
     norm += wt;
     for (vector<int>::const_iterator it=this_state.active_constraints.begin(); it!=this_state.active_constraints.end(); ++it) {
-        stats[*it] += wt;
+        stats_acc[*it] += wt;
     }
     return;
 }
 
 void BasinModel::normalize_stats() {
-    for (vector<double>::iterator it=stats.begin(); it!=stats.end(); ++it) {
-        *it /= norm;
+    int nstats = stats.size();
+    for (int i=0; i<nstats; i++) {
+        stats[i] = stats_acc[i] / norm;
     }
+    // Release the accumulator so that only one basin holds one at a time
+    vector<double>().swap(stats_acc);
     return;
 }
 
@@ -106,8 +124,8 @@ void BasinModel::normalize_stats() {
 IndependentBasin::IndependentBasin(int N, int basin_num, RNG* rng) : BasinModel(N,basin_num,rng), prefactor(1), above_thresh_bool(N,0)
 {
     stats.assign(N, 0);
-    for (vector<double>::iterator it = stats.begin(); it != stats.end(); ++it) {
-        double u = 0.1*((double) rand() / (double) RAND_MAX) + 0.45;
+    for (vector<stat_t>::iterator it = stats.begin(); it != stats.end(); ++it) {
+        double u = 0.1*rng->uniform() + 0.45;
         (*it) = u;
     }
     m.assign(stats,N,1);
@@ -150,17 +168,19 @@ void IndependentBasin::update_thresh_list() {
     return;
 }
 
-double IndependentBasin::P_state(const State& this_state) const {
+template <int W>
+double IndependentBasin::P_state_lanes(const State& this_state) const {
     
+    const word_lane* bits = this_state.bits.data();
     double P = prefactor;
-    for (vector<int>::const_iterator neuron_iter = this_state.on_neurons.begin(); neuron_iter != this_state.on_neurons.end(); ++neuron_iter) {
-        if (above_thresh_bool[*neuron_iter] == 0) {
-            P *= (m.at(*neuron_iter) / (1-m.at(*neuron_iter)));
+    for_each_on<W>(bits, this_state.bits.size(), [&](int n) {
+        if (above_thresh_bool[n] == 0) {
+            P *= (m.at(n) / (1-m.at(n)));
         }
-    }
+    });
     
     for (vector<int>::const_iterator thresh_iter=above_thresh_list.begin(); thresh_iter!=above_thresh_list.end(); ++thresh_iter) {
-        if (this_state.word[*thresh_iter]==1) {
+        if (word_bit(bits, *thresh_iter)) {
             P *= m.at(*thresh_iter);
         } else {
             P *= (1 - m.at(*thresh_iter));
@@ -170,12 +190,52 @@ double IndependentBasin::P_state(const State& this_state) const {
     return P;
 }
 
+double IndependentBasin::P_state(const State& this_state) const {
+    // Specialised on the lane count of the packed word (see Word.h)
+    switch (word_width) {
+        case 1: return P_state_lanes<1>(this_state);
+        case 2: return P_state_lanes<2>(this_state);
+        case 4: return P_state_lanes<4>(this_state);
+        default: return P_state_lanes<0>(this_state);
+    }
+}
+
 vector<char> IndependentBasin::sample() {
     vector<char> this_sample (N);
+    sample(1, this_sample.data(), *rng);
+    return this_sample;
+}
+
+void IndependentBasin::sample(int nsamples, char* out, RNG& this_rng) const {
+    // Neurons with low firing rates are sampled column-wise by geometric
+    // skip-ahead: the gap to the next sample in which neuron i fires is
+    // Geometric(m_i), so the cost is proportional to the number of spikes.
+    double skip_thresh = 0.1;
+    fill(out, out + (long) nsamples*N, 0);
     for (int i=0; i<N; i++) {
-        this_sample[i] = (rng->bernoulli(m.at(i))) ? 1 : 0;
+        double p = m.at(i);
+        if (p <= 0) {
+            continue;
+        } else if (p < skip_thresh) {
+            // log1p keeps log_q < 0 for tiny p, where log(1-p) rounds to 0
+            double log_q = log1p(-p);
+            long s = -1;
+            while (true) {
+                // 1-uniform lies in (0,1], so the numerator is finite, but for
+                // tiny p the gap can exceed any long (or be inf): it is
+                // checked against the remaining samples before the cast
+                double skip = floor(log(1 - this_rng.uniform()) / log_q);
+                if (!(skip < nsamples - s - 1)) break;
+                s += 1 + (long) skip;
+                out[s*N + i] = 1;
+            }
+        } else {
+            for (long s=0; s<nsamples; s++) {
+                out[s*N + i] = (this_rng.bernoulli(p)) ? 1 : 0;
+            }
+        }
     }
-    return this_sample;
+    return;
 }
 
 paramsStruct IndependentBasin::get_params() {
@@ -14,9 +14,21 @@
 #include <map>
 #include <string>
 
+#include "Parallel.h"
+#include "Word.h"
+
 
 using namespace std;
 
+// Storage type for the basin moment statistics and the exported parameter
+// matrices. Compile with -DSINGLE_PRECISION_STATS to store them as float,
+// which halves their footprint for large N; accumulation is always in double.
+#ifdef SINGLE_PRECISION_STATS
+typedef float stat_t;
+#else
+typedef double stat_t;
+#endif
+
 struct State;       // Defined in EMBasins.h
 class RNG;
 
@@ -95,23 +107,26 @@ vector<T>* myMatrix<T>::data() { return &matrix_data; }
 // *****************************************************************
 
 // *********************** paramsStruct ****************************
-class paramsStruct {            // Variable-sized structure holding double matrices
+class paramsStruct {            // Variable-sized structure holding stat_t matrices
 public:
     
     paramsStruct();
+    paramsStruct(const paramsStruct&);
+    paramsStruct& operator=(const paramsStruct&);
     int get_nfields();
-    void addField(string, myMatrix<double>&);
+    void addField(string, myMatrix<stat_t>&);
     const char** fieldNamesArray();
-    vector<double>* getFieldData(int);
+    vector<stat_t>* getFieldData(int);
     int getFieldN(int);
     int getFieldM(int);
     const char* getFieldName(int);
     
 private:
     int nfields;
-    map<string, myMatrix<double>* > fields;
-    vector<const char*> fieldNames;
+    map<string, myMatrix<stat_t>* > fields;
+    vector<const char*> fieldNames;     // Point into the keys of fields
     
+    void update_field_names();
 };
 // *****************************************************************
 
@@ -119,7 +134,7 @@ private:
 class BasinModel
 {
 public:
-    BasinModel(int N, int basin_num, RNG* rng) : N(N), basin_num(basin_num), rng(rng) {};
+    BasinModel(int N, int basin_num, RNG* rng) : N(N), basin_num(basin_num), word_width(word_kernel_width(N)), rng(rng) {};
 
     void reset_stats();
     void increment_stats(const State&);
@@ -132,9 +147,11 @@ public:
 protected:
     int N;
     int basin_num;
+    int word_width;     // word_kernel_width(N): lane count P_state is specialised for
     double norm;
     
-    vector<double> stats;
+    vector<stat_t> stats;
+    vector<double> stats_acc;   // Double-precision accumulator; only allocated between reset_stats() and normalize_stats()
     RNG* rng;
 };
 // ***************************************************************
@@ -151,21 +168,49 @@ public:
     void doMLE(double);
     double P_state(const State&) const;
     vector<char> sample();
+    void sample(int, char*, RNG&) const;    // nsamples x N words, row-major, into a preallocated buffer
     
     paramsStruct get_params();
 //    int nparams() const;
 //    vector<double> get_params() const;
 private:
 //    vector<double> m;
-    myMatrix<double> m;
+    myMatrix<stat_t> m;
     vector<char> above_thresh_bool;
     vector<int> above_thresh_list;
     
     double prefactor;
     
     void update_thresh_list();
+    template <int W> double P_state_lanes(const State&) const;
 };
 // ***************************************************************
 
 
+// ************************** P_state_batch ************************
+// Evaluates basins[k].P_state(*states[s]) for every state and every basin,
+// writing out[s*basins.size() + k]. States are scored in blocks, one basin at
+// a time, so that a basin's parameters stay in cache across the block. The
+// blocks are shared out over nthreads threads (P_state is const).
+template <class BasinT>
+void P_state_batch(const vector<BasinT>& basins, const vector<State*>& states, double* out, int nthreads=1) {
+    const int block = 256;
+    int nbasins = basins.size();
+    int nstates = states.size();
+    int nblocks = (nstates + block - 1) / block;
+    parallel_for(nblocks, nthreads, [&](int b) {
+        int s0 = b*block;
+        int s1 = (s0+block < nstates) ? s0+block : nstates;
+        for (int k=0; k<nbasins; k++) {
+            const BasinT& basin = basins[k];
+            for (int s=s0; s<s1; s++) {
+                out[s*nbasins + k] = basin.P_state(*states[s]);
+            }
+        }
+    });
+    return;
+}
+// ***************************************************************
+
+
 #endif /* defined(____BasinModel__) */
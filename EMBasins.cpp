@@ -11,6 +11,10 @@
 #include "EMBasins.h"
 #include "BasinModel.h"
 #include "TreeBasin.h"
+#include "Parallel.h"
+#include "Markov.h"
+
+#include <gsl/gsl_cblas.h>
 
 // Choose either MATLAB or PYTHON to link to via Boost
 //#define MATLAB
@@ -19,25 +23,34 @@
 #ifdef MATLAB
 #include "matrix.h"
 #include "mex.h"
-// Comment this if you want just EMBasins (i.e. no temporal correlations)
-// Leave uncommented if you want HMM i.e. temporal correlations
-// Only applies to Matlab as it allows binding only one function named mexFunction,
-//  whereas python allows separate bindings for pyHMM and pyEMBasins, etc.
-#define matlabHMM
-// See below: typedef <...> BasinType for spatial correlations
+// Matlab allows binding only one function named mexFunction, so the temporal
+//  model (HMM, EMBasins i.e. no temporal correlations, or Autocorr) is chosen
+//  by an optional string argument, see mexFunction() below.
 #endif
 
 #include <queue>
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#include <limits>
 #include <exception>
+#include <stdexcept>
 
 
+// Basin models selectable at run time, by name, from Python and Matlab.
+// All models are compiled into the library (see the explicit instantiations
+// at the end of this file); the name is resolved once at the API boundary and
+// everything below runs on the fully templated EMBasins<BasinT>/HMM<BasinT>.
+enum BasinModelType { TREE_BASIN, INDEPENDENT_BASIN };
 
-// Selects which basin model to use -- one of the two below
-typedef TreeBasin BasinType;
-//typedef IndependentBasin BasinType;
+BasinModelType basin_model_type(const string& name) {
+    if (name == "tree" || name == "TreeBasin") {
+        return TREE_BASIN;
+    } else if (name == "independent" || name == "IndependentBasin") {
+        return INDEPENDENT_BASIN;
+    }
+    throw invalid_argument("Unknown basin model '" + name + "': use 'tree' or 'independent'.");
+}
 
 #ifdef MATLAB
 
@@ -58,14 +71,14 @@ void writeOutputStruct(int pos, vector<paramsStruct>& value, mxArray**& plhs) {
     int n = 0;
     for (vector<paramsStruct>::iterator it = value.begin(); it != value.end(); ++it) {
         for (int i=0; i < it->get_nfields(); i++) {
-            vector<double>* data = it->getFieldData(i);
+            vector<stat_t>* data = it->getFieldData(i);
             
             int N = it->getFieldN(i);
             int M = it->getFieldM(i);
             mxArray* field_data = mxCreateDoubleMatrix(N, M, mxREAL);
             double* pr = mxGetPr(field_data);
             double* iter_pr = pr;
-            for (vector<double>::iterator data_it=data->begin(); data_it != data->end(); ++data_it) {
+            for (vector<stat_t>::iterator data_it=data->begin(); data_it != data->end(); ++data_it) {
                 *iter_pr++ = *data_it;
             }            
             mxSetFieldByNumber(out_struct, n, i, field_data);
@@ -78,127 +91,126 @@ void writeOutputStruct(int pos, vector<paramsStruct>& value, mxArray**& plhs) {
 
 #endif
 
-vector<double> mpow(vector<double>& matrix, int n, int k) {
+// y = A x for a K x K row-major matrix A, or y = A^T x if transpose
+inline void trans_gemv(bool transpose, const double* A, const double* x, double* y, int K) {
+    cblas_dgemv(CblasRowMajor, transpose ? CblasTrans : CblasNoTrans, K, K, 1.0, A, K, x, 1, 0.0, y, 1);
+    return;
+}
 
-    if (k==1) {
-        return matrix;
-    } else if (k==0) {
-        vector<double> ident (n*n,0);
-        for (int i=0; i<n; i++) {
-            ident[n*i + i] = 1;
-        }
-        return ident;
-    } else {
-        vector<double> ml = mpow(matrix, n, floor(k/2));
-        vector<double> mr = mpow(matrix, n, k - floor(k/2));
-        vector<double> mout (n*n);
-        for (int i=0; i<n; i++) {
-            for (int j=0; j<n; j++) {
-                for (int k=0; k<n; k++) {
-                    mout[n*i+j] += ml[n*k + j] * mr[n*i + k];
-                }
-            }
+// C = A B + beta C for K x K row-major matrices
+inline void mat_mul(const double* A, const double* B, double* C, int K, double beta=0) {
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, K, K, K, 1.0, A, K, B, K, beta, C, K);
+    return;
+}
+
+// max_m (row[m] + w[m]) for the log-space Viterbi, with the first m attaining
+// it in arg. The max runs over four independent lanes, which compiles to
+// packed compares; the argmax is a second scan that stops at the first hit.
+inline double max_plus(const double* row, const double* w, int K, int& arg) {
+    const double minus_inf = -numeric_limits<double>::infinity();
+    double lane[4] = {minus_inf, minus_inf, minus_inf, minus_inf};
+    int m = 0;
+    for (; m+4<=K; m+=4) {
+        for (int j=0; j<4; j++) {
+            double x = row[m+j] + w[m+j];
+            lane[j] = (x > lane[j]) ? x : lane[j];
         }
-        return mout;        
     }
+    double best = max(max(lane[0], lane[1]), max(lane[2], lane[3]));
+    for (; m<K; m++) {
+        best = max(best, row[m] + w[m]);
+    }
+    arg = 0;
+    while (arg < K-1 && row[arg] + w[arg] != best) {
+        arg++;
+    }
+    return best;
+}
+
+// Smallest value kept by a beam over x[0..K): the larger of floor_value and,
+// when 0 < width < K, the width-th largest entry (ties may keep a few more)
+inline double beam_cutoff(const double* x, int K, int width, double floor_value, vector<double>& scratch) {
+    if (width <= 0 || width >= K) {
+        return floor_value;
+    }
+    scratch.assign(x, x+K);
+    nth_element(scratch.begin(), scratch.begin() + (width-1), scratch.end(), greater<double>());
+    return max(floor_value, scratch[width-1]);
+}
 
+// Orders runs by start bin, for lower_bound(runs, t)
+static bool run_starts_before(const ObsRun& run, int t) {
+    return run.start < t;
 }
 
-#ifdef MATLAB
+// Bins per block of the fused HMM E-step, see HMM::add_estep_stats()
+const int estep_block = 64;
 
-void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
- // #ifdef matlabHMM, then this function uses temporal correlations, i.e. uses HMM(),
- // and signature from matlab is as below
- // [freq,w,m,P,logli,prob] = EMBasins(st, unobserved_edges, binsize, nbasins, niter)
- // #ifndef matlabHMM, then this function doesn't use temporal correlations, i.e. uses EMBasins(),
- // and signature from matlab is as below
- // [freq,w,m,P,logli,prob] = EMBasins(st, st_test, unobserved_edges, binsize, nbasins, niter)
+// Bins per work item when Autocorr tabulates its self-transition factors
+const int self_block = 4096;
 
-    cout << "Reading inputs..." << endl;
-    int N = mxGetNumberOfElements(prhs[0]);
-    vector<vector<double> > st (N);    
+// Divides p[0..n) by its sum and returns the sum
+inline double normalize_probs(double* p, int n) {
+    double norm = 0;
+    for (int i=0; i<n; i++) {
+        norm += p[i];
+    }
+    for (int i=0; i<n; i++) {
+        p[i] /= norm;
+    }
+    return norm;
+}
+
+// off[i] = sum_{j != i} x[j] for i in [0,n), from prefix and suffix sums, so
+// there is no cancellation when one entry dominates
+inline void sums_excluding(const double* x, int n, double* off) {
+    double prefix = 0;
+    for (int i=0; i<n; i++) {
+        off[i] = prefix;
+        prefix += x[i];
+    }
+    double suffix = 0;
+    for (int i=n-1; i>=0; i--) {
+        off[i] += suffix;
+        suffix += x[i];
+    }
+    return;
+}
+
+#ifdef MATLAB
+
+vector<vector<double> > readSpikeTimes(const mxArray* cell) {
+    int N = mxGetNumberOfElements(cell);
+    vector<vector<double> > st (N);
     for (int i=0; i<N; i++) {
-        mxArray* elem = mxGetCell(prhs[0], i);
+        mxArray* elem = mxGetCell(cell, i);
         double* elem_pr = mxGetPr(elem);
         int nspikes = mxGetNumberOfElements(elem);
         for (int n=0; n<nspikes; n++) {
             st[i].push_back(elem_pr[n]);
         }
     }
+    return st;
+}
 
-#ifdef matlabHMM
-    int n_unobserved_blocks = mxGetM(prhs[1]);
+template <class BasinT>
+void mexHMM(vector<vector<double> >& st, const mxArray* unobserved_edges, double binsize, int nbasins, int niter, mxArray** plhs) {
+    int N = st.size();
+    int n_unobserved_blocks = mxGetM(unobserved_edges);
     vector<double> unobserved_edges_low (n_unobserved_blocks);
     vector<double> unobserved_edges_high (n_unobserved_blocks);
-    if (n_unobserved_blocks > 0 && mxGetN(prhs[1]) != 2) {
+    if (n_unobserved_blocks > 0 && mxGetN(unobserved_edges) != 2) {
         cerr << "Unobserved edges must be empty or have two columns." << endl;
     } else {
-        double* unobserved_edges_pr = mxGetPr(prhs[1]);
+        double* unobserved_edges_pr = mxGetPr(unobserved_edges);
         for (int n=0; n<n_unobserved_blocks; n++) {
             unobserved_edges_low[n] = unobserved_edges_pr[n];
             unobserved_edges_high[n] = unobserved_edges_pr[n_unobserved_blocks + n];
         }
     }
-#endif
-
-#ifndef matlabHMM
-    int N1 = mxGetNumberOfElements(prhs[1]);
-    vector<vector<double> > st_test (N1);    
-    for (int i=0; i<N1; i++) {
-        mxArray* elem = mxGetCell(prhs[1], i);
-        double* elem_pr = mxGetPr(elem);
-        int nspikes = mxGetNumberOfElements(elem);
-        for (int n=0; n<nspikes; n++) {
-            st_test[i].push_back(elem_pr[n]);
-        }
-    }
-#endif
-
-    double binsize = *mxGetPr(prhs[2]);
-    int nbasins = (int) *mxGetPr(prhs[3]);
-    int niter = (int) *mxGetPr(prhs[4]);    
 
-  /*
-    // Autocorrelation model
-    Autocorr<BasinType> basin_obj(st, binsize, nbasins);
-    vector<double> logli = basin_obj.train(niter);
-    cout << "Viterbi..." << endl;
-    vector<int> alpha = basin_obj.viterbi();
-//    cout << "P...." << endl;
-//    vector<double> P = basin_obj.get_P();
-//    cout << "Pred prob..." << endl;
-//    pair<vector<double>, vector<double> > tmp = basin_obj.pred_prob();
-//    vector<double> pred_prob = tmp.first;
-//    vector<double> hist = tmp.second;
-    //    vector<unsigned long> hist = basin_obj.state_hist();
-//    int T = floor(P.size() / nbasins);
-    int T = alpha.size();
-    
-    cout << "Params..." << endl;
-    vector<paramsStruct> params = basin_obj.basin_params();
-    
-    writeOutputMatrix(0, logli, niter, 1, plhs);
-//    writeOutputMatrix(1, basin_obj.get_trans(), nbasins, nbasins, plhs);
-    //    writeOutputMatrix(2, P, nbasins, T, plhs);
-//    writeOutputMatrix(2, basin_obj.emiss_prob(), nbasins, T, plhs);
-    //    cout << "Microstates..." << endl;
-    //    writeOutputMatrix(2, basin_obj.state_v_time(), 1, T, plhs);
-    writeOutputMatrix(1, alpha, T, 1, plhs);
-//    writeOutputMatrix(4, pred_prob, 1, pred_prob.size(), plhs);
-//    writeOutputMatrix(5, hist, 1, hist.size(), plhs);
-    writeOutputStruct(2, params, plhs);
-    writeOutputMatrix(3, basin_obj.get_forward(), nbasins,T,plhs);
-    writeOutputMatrix(4, basin_obj.get_backward(), nbasins,T,plhs);
-    writeOutputMatrix(5, basin_obj.get_basin_trans(), 4*N,nbasins,plhs);
-    writeOutputMatrix(6, basin_obj.w, nbasins,1,plhs);
-    writeOutputMatrix(7, basin_obj.P_indep(), nbasins, T, plhs);
-//    cout << "Samples..." << endl;
-//    writeOutputMatrix(3, basin_obj.sample(100000), N,100000, plhs);
-    */
-    
-#ifdef matlabHMM
     // Hidden Markov model
-    HMM<BasinType> basin_obj(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins);
+    HMM<BasinT> basin_obj(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins);
     vector<double> train_logli;
     vector<double> test_logli;
     tie(train_logli,test_logli) = basin_obj.train(niter);
@@ -238,12 +250,17 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     writeOutputMatrix(8, basin_obj.stationary_prob(), 1,nbasins, plhs);
     writeOutputMatrix(9, train_logli, niter, 1, plhs);
     writeOutputMatrix(10, test_logli, niter, 1, plhs);
-#endif    
-    
-#ifndef matlabHMM
+    return;
+}
+
+template <class BasinT>
+void mexEMBasins(vector<vector<double> >& st, const mxArray* st_test_cell, double binsize, int nbasins, int niter, mxArray** plhs) {
+    int N = st.size();
+    vector<vector<double> > st_test = readSpikeTimes(st_test_cell);
+
     // Mixture model
     cout << "Initializing EM..." << endl;
-    EMBasins<BasinType> basin_obj(st, st_test, binsize, nbasins);
+    EMBasins<BasinT> basin_obj(st, st_test, binsize, nbasins);
     
     cout << "Training model..." << endl;
     vector<double> logli;
@@ -283,8 +300,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     writeOutputMatrix(11, logli, niter, 1, plhs);
     writeOutputMatrix(12, test_logli, niter, 1, plhs);
 //    writeOutputMatrix(6, P_test, nbasins, P_test.size()/nbasins, plhs);
-
-#endif    
     
     /*
     // k-fold cross-validation
@@ -293,7 +308,92 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     
     writeOutputMatrix(0, logli, niter, kfolds, plhs);
     */
+    return;
+}
+
+template <class BasinT>
+void mexAutocorr(vector<vector<double> >& st, double binsize, int nbasins, int niter, mxArray** plhs) {
+    int N = st.size();
+
+    // Autocorrelation model
+    Autocorr<BasinT> basin_obj(st, binsize, nbasins);
+    vector<double> logli = basin_obj.train(niter);
+    cout << "Viterbi..." << endl;
+    vector<int> alpha = basin_obj.viterbi();
+    int T = alpha.size();
     
+    cout << "Params..." << endl;
+    vector<paramsStruct> params = basin_obj.basin_params();
+    
+    writeOutputMatrix(0, logli, niter, 1, plhs);
+    writeOutputMatrix(1, alpha, T, 1, plhs);
+    writeOutputStruct(2, params, plhs);
+    writeOutputMatrix(3, basin_obj.get_forward(), nbasins,T,plhs);
+    writeOutputMatrix(4, basin_obj.get_backward(), nbasins,T,plhs);
+    writeOutputMatrix(5, basin_obj.get_basin_trans(), 4*N,nbasins,plhs);
+    writeOutputMatrix(6, basin_obj.w, nbasins,1,plhs);
+    writeOutputMatrix(7, basin_obj.P_indep(), nbasins, T, plhs);
+    return;
+}
+
+template <class BasinT>
+void mexRun(const string& temporal_model, vector<vector<double> >& st, const mxArray* prhs1, double binsize, int nbasins, int niter, mxArray** plhs) {
+    if (temporal_model == "hmm") {
+        mexHMM<BasinT>(st, prhs1, binsize, nbasins, niter, plhs);
+    } else if (temporal_model == "mixture") {
+        mexEMBasins<BasinT>(st, prhs1, binsize, nbasins, niter, plhs);
+    } else if (temporal_model == "autocorr") {
+        mexAutocorr<BasinT>(st, binsize, nbasins, niter, plhs);
+    } else {
+        mexErrMsgTxt("Unknown temporal model: use 'hmm', 'mixture' or 'autocorr'.");
+    }
+    return;
+}
+
+string readOptionalString(int pos, int nrhs, const mxArray *prhs[], const string& default_value) {
+    if (nrhs <= pos || mxIsEmpty(prhs[pos])) {
+        return default_value;
+    }
+    char* buf = mxArrayToString(prhs[pos]);
+    string value (buf);
+    mxFree(buf);
+    return value;
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+ // The temporal model is chosen by the optional 6th argument (default 'hmm')
+ // and the basin model by the optional 7th argument (default 'tree'):
+ // 'hmm': temporal correlations, i.e. uses HMM(), signature from matlab is
+ // [params,trans,P,emiss_prob,alpha,pred_prob,hist,samples,stationary_prob,train_logli,test_logli] = ...
+ //      EMBasins(st, unobserved_edges, binsize, nbasins, niter, 'hmm', 'tree'|'independent')
+ // 'mixture': no temporal correlations, i.e. uses EMBasins(), signature from matlab is
+ // [params,w,samples,words,hist,words_test,hist_test,P,P_test,prob,prob_test,logli,test_logli] = ...
+ //      EMBasins(st, st_test, binsize, nbasins, niter, 'mixture', 'tree'|'independent')
+ // 'autocorr': autocorrelation model, i.e. uses Autocorr() (second argument is ignored)
+ // [logli,alpha,params,forward,backward,basin_trans,w,P_indep] = ...
+ //      EMBasins(st, [], binsize, nbasins, niter, 'autocorr', 'tree'|'independent')
+
+    cout << "Reading inputs..." << endl;
+    vector<vector<double> > st = readSpikeTimes(prhs[0]);
+
+    double binsize = *mxGetPr(prhs[2]);
+    int nbasins = (int) *mxGetPr(prhs[3]);
+    int niter = (int) *mxGetPr(prhs[4]);    
+    string temporal_model = readOptionalString(5, nrhs, prhs, "hmm");
+    string basin_model = readOptionalString(6, nrhs, prhs, "tree");
+
+    try {
+        switch (basin_model_type(basin_model)) {
+            case TREE_BASIN:
+                mexRun<TreeBasin>(temporal_model, st, prhs[1], binsize, nbasins, niter, plhs);
+                break;
+            case INDEPENDENT_BASIN:
+                mexRun<IndependentBasin>(temporal_model, st, prhs[1], binsize, nbasins, niter, plhs);
+                break;
+        }
+    } catch (const invalid_argument& e) {
+        mexErrMsgTxt(e.what());
+    }
     
     return;
 }
@@ -309,6 +409,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 namespace py = boost::python;
 namespace np = boost::python::numpy;
 
+#include <memory>
+#include <thread>
+#include <mutex>
+
 template <typename T>
 np::ndarray writePyOutputMatrix(vector<T> value, int rows, int cols) {
 // convert C++ vector / 2D vector to a Python numpy array of rows x cols
@@ -339,14 +443,14 @@ py::list writePyOutputStruct(vector<paramsStruct>& value) {
     int n = 0;
     for (vector<paramsStruct>::iterator it = value.begin(); it != value.end(); ++it) {
         for (int i=0; i < it->get_nfields(); i++) {
-            vector<double>* data = it->getFieldData(i);
+            vector<stat_t>* data = it->getFieldData(i);
             int N = it->getFieldN(i);
             int M = it->getFieldM(i);
-            np::dtype dt = np::dtype::get_builtin<double>();    // double hard-coded
+            // float32 arrays when compiled with SINGLE_PRECISION_STATS, float64 otherwise
+            np::dtype dt = np::dtype::get_builtin<stat_t>();
             py::tuple shape = py::make_tuple(N,M);
             np::ndarray arr = np::zeros(shape, dt);
-            // double hard-coded
-            std::copy(data->begin(), data->end(), reinterpret_cast<double*>(arr.get_data()));
+            std::copy(data->begin(), data->end(), reinterpret_cast<stat_t*>(arr.get_data()));
             outstruct.append(arr);
         }
         n++;
@@ -354,28 +458,50 @@ py::list writePyOutputStruct(vector<paramsStruct>& value) {
     return outstruct;
 }
 
-py::list writePyOutputStructDict(vector<paramsStruct>& value) {
+// One field of a paramsStruct, copied out of the basin it points into
+struct ParamsField {
+    string name;
+    int N, M;
+    vector<stat_t> data;
+};
+
+vector<vector<ParamsField> > copyParams(vector<paramsStruct>& value) {
+    // Take the copy while the basins cannot change, e.g. under a model's lock
+    vector<vector<ParamsField> > out (value.size());
+    for (int b=0; b<value.size(); b++) {
+        for (int i=0; i < value[b].get_nfields(); i++) {
+            ParamsField field;
+            field.name = value[b].getFieldName(i);
+            field.N = value[b].getFieldN(i);
+            field.M = value[b].getFieldM(i);
+            field.data = *(value[b].getFieldData(i));
+            out[b].push_back(field);
+        }
+    }
+    return out;
+}
+
+py::list writePyOutputStructDict(const vector<vector<ParamsField> >& value) {
     py::list outlistdict;
-    int n = 0;
-    for (vector<paramsStruct>::iterator it = value.begin(); it != value.end(); ++it) {
+    for (vector<vector<ParamsField> >::const_iterator it = value.begin(); it != value.end(); ++it) {
         py::dict outstruct;
-        for (int i=0; i < it->get_nfields(); i++) {
-            vector<double>* data = it->getFieldData(i);
-            int N = it->getFieldN(i);
-            int M = it->getFieldM(i);
-            np::dtype dt = np::dtype::get_builtin<double>();    // double hard-coded
-            py::tuple shape = py::make_tuple(N,M);
+        for (vector<ParamsField>::const_iterator field = it->begin(); field != it->end(); ++field) {
+            // float32 arrays when compiled with SINGLE_PRECISION_STATS, float64 otherwise
+            np::dtype dt = np::dtype::get_builtin<stat_t>();
+            py::tuple shape = py::make_tuple(field->N,field->M);
             np::ndarray arr = np::zeros(shape, dt);
-            // double hard-coded
-            std::copy(data->begin(), data->end(), reinterpret_cast<double*>(arr.get_data()));
-            outstruct[it->getFieldName(i)] = arr;
+            std::copy(field->data.begin(), field->data.end(), reinterpret_cast<stat_t*>(arr.get_data()));
+            outstruct[field->name] = arr;
         }
-        n++;
         outlistdict.append(outstruct);
     }
     return outlistdict;
 }
 
+py::list writePyOutputStructDict(vector<paramsStruct>& value) {
+    return writePyOutputStructDict(copyParams(value));
+}
+
 vector<vector<double>> getSpikeTimes(py::list nrnspiketimes) {
     int N = len(nrnspiketimes); 
     vector<vector<double>> st (N);
@@ -406,13 +532,240 @@ vector<double> getVec(np::ndarray arr) {
     return v;
 }
 
-py::list pyEMBasins(py::list nrnspiketimes, py::list nrnspiketimes_test, double binsize, int nbasins, int niter) {
-// params,w,samples,state_hist,P,prob,logli,P_test = pyEMBasins(spiketimes, spiketimes_test, binsize, nbasins, niter)
+// Releases the GIL for its lifetime; no Python object may be touched meanwhile
+class ReleaseGIL
+{
+public:
+    ReleaseGIL() : state (PyEval_SaveThread()) {};
+    ~ReleaseGIL() {PyEval_RestoreThread(state);};
+private:
+    PyThreadState* state;
+    ReleaseGIL(const ReleaseGIL&);
+    ReleaseGIL& operator=(const ReleaseGIL&);
+};
+
+// A fit driven from Python, split so that the GIL is only needed at its ends:
+// the inputs are copied out of Python before construction, compute() does all
+// of the C++ work (and may run on another thread), and write() builds the
+// Python outputs under the GIL.
+class PyFit
+{
+public:
+    PyFit() : stop (false), stopped (false) {};
+    virtual ~PyFit() {};
+    virtual void compute() = 0;
+    virtual py::list write() = 0;
+    void cancel() {stop = true;};
+    bool cancelled() const {return stopped;};   // Training was cut short by cancel()
+protected:
+    atomic<bool> stop;          // The model's stop flag
+    bool stopped;
+};
+
+void getUnobservedEdges(np::ndarray& lo, np::ndarray& hi, vector<double>& low, vector<double>& high) {
+    int n_unobserved_blocks = len(lo);
+    low.assign(n_unobserved_blocks, 0);
+    high.assign(n_unobserved_blocks, 0);
+    if (n_unobserved_blocks>0) {
+        low = getVec(lo);
+        high = getVec(hi);
+    }
+    return;
+}
+
+template <class BasinT>
+class EMBasinsFit : public PyFit
+{
+public:
+    EMBasinsFit(vector<vector<double> >& st, vector<vector<double> >& st_test, double binsize, int nbasins, int niter) :
+        st (st), st_test (st_test), binsize (binsize), nbasins (nbasins), niter (niter) {};
+
+    void compute() {
+        // Mixture model
+        cout << "Initializing EM..." << endl;
+        basin_obj.reset(new EMBasins<BasinT>(st, st_test, binsize, nbasins));
+        basin_obj->set_stop_flag(&stop);
+
+        cout << "Training model..." << endl;
+        tie(logli,test_logli) = basin_obj->train(niter);
+        if ((stopped = basin_obj->stop_requested())) {
+            return;
+        }
+        //vector<double> test_logli = basin_obj->test_logli;
+
+        // Aditya modified: I've added testing at each iter in train()
+        //  so no need of testing at the end of training
+        //cout << "Testing..." << endl;
+        //vector<double> P_test;
+        //double logli_test;
+        // ::test() returns P_test as nbasins x nbins,
+        // unlike ::P_test() or P() which return nbasins x npatterns
+        //tie(P_test,logli_test) = basin_obj->test(st_test,binsize);
+
+        params = basin_obj->basin_params();
+        cout << basin_obj->nstates() << " states." << endl;
+
+//        cout << "Getting samples..." << endl;
+        samples = basin_obj->sample(nsamples);
+        word_list = basin_obj->word_list();
+        state_hist = basin_obj->state_hist();
+        word_list_test = basin_obj->word_list_test();
+        test_hist = basin_obj->test_hist();
+        P = basin_obj->P();
+        P_test = basin_obj->P_test();
+        all_prob = basin_obj->all_prob();
+        test_prob = basin_obj->test_prob();
+    }
+
+    py::list write() {
+        int N = st.size();
+        int nstates = basin_obj->nstates();
+        int nstates_test = basin_obj->nstates_test();
+
+        cout << "Writing outputs..." << endl;
+        py::list outlist = py::list();
+
+        // NOTE: python uses row-major order just like C/C++, and unlike matlab
+        // Thus, call as writePyOutputMatrix(Cmatrix, Crow, Ccolumn)
+        // unlike in the matlab bindings above, where Crow and Ccolumn are flipped
+        outlist.append(writePyOutputStructDict(params));
+        outlist.append(writePyOutputMatrix(basin_obj->w,1,nbasins));
+        outlist.append(writePyOutputMatrix(samples,nsamples,N));
+        outlist.append(writePyOutputMatrix(word_list,nstates,N));
+        outlist.append(writePyOutputMatrix(state_hist,1,nstates));
+        outlist.append(writePyOutputMatrix(word_list_test,nstates_test,N));
+        outlist.append(writePyOutputMatrix(test_hist,1,nstates_test));
+        // P and P_test are the Qmodes/Z (cf. my MixtureModel.py calcModePosterior())
+        //  for each state in train_states and test_states
+        outlist.append(writePyOutputMatrix(P,nstates,nbasins));
+        outlist.append(writePyOutputMatrix(P_test,nstates_test,nbasins));
+        // all_prob and test_prob are the Z's for each state in train_states and test_states
+        outlist.append(writePyOutputMatrix(all_prob,1,nstates));
+        outlist.append(writePyOutputMatrix(test_prob,1,nstates_test));
+        outlist.append(writePyOutputMatrix(logli,1,niter));
+        outlist.append(writePyOutputMatrix(test_logli,1,niter));
+        //outlist.append(logli_test);
+
+        // Aditya notes: P and P_test correspond to my Qmodes/Z (see MixtureModel.py calcModePosterior())
+        //  dim is nModes x nStates i.e. nbasins here x number of distinct states
+        // However, my Qmodes is nModes x ntimesteps
+        // Still, can use the state/pattern at each time step to choose its P from this matrix
+        // To calculate log likelihood, I need Z at each time step/bin!
+        //  (w.Qmodes)/Z != w.P = w.(Qmodes/Z) won't work because P is normalized sum=1 at each time step
+
+        return outlist;
+    }
+private:
+    static const int nsamples = 100000;
+    vector<vector<double> > st;
+    vector<vector<double> > st_test;
+    double binsize;
+    int nbasins;
+    int niter;
+
+    unique_ptr<EMBasins<BasinT> > basin_obj;      // Kept for params, which point into its basins
+    vector<double> logli;
+    vector<double> test_logli;
+    vector<paramsStruct> params;
+    vector<char> samples;
+    vector<char> word_list;
+    vector<unsigned long> state_hist;
+    vector<char> word_list_test;
+    vector<unsigned long> test_hist;
+    vector<double> P;
+    vector<double> P_test;
+    vector<double> all_prob;
+    vector<double> test_prob;
+};
+
+// Handle to a fit running on its own thread, returned by the bindings with
+// background=True. The thread never takes the GIL; result() waits for it with
+// the GIL released and then builds the outputs. Dropping the handle cancels
+// the fit without waiting: the thread shares ownership of the fit and frees
+// it when its current iteration ends.
+class BackgroundFit
+{
+public:
+    BackgroundFit(PyFit* fit) : job (new Job(fit)) {
+        boost::shared_ptr<Job> this_job = job;
+        worker = thread([this_job]() {
+            try {
+                this_job->fit->compute();
+            } catch (...) {
+                this_job->error = current_exception();
+            }
+            this_job->finished = true;
+        });
+    };
+    ~BackgroundFit() {
+        // Runs under the GIL, so the thread is detached rather than joined
+        job->fit->cancel();
+        lock_guard<mutex> lock (join_mutex);
+        if (worker.joinable()) {
+            worker.detach();
+        }
+    };
+
+    bool done() const {return job->finished;};
+    void cancel() {job->fit->cancel();};     // Training stops after its current iteration
+    py::list result() {
+        {
+            ReleaseGIL nogil;
+            join();
+        }
+        if (job->error) {
+            rethrow_exception(job->error);
+        }
+        if (job->fit->cancelled()) {
+            throw runtime_error("The fit was cancelled before it finished.");
+        }
+        return job->fit->write();
+    };
+private:
+    struct Job {
+        Job(PyFit* fit) : fit (fit), finished (false) {};
+        unique_ptr<PyFit> fit;
+        atomic<bool> finished;
+        exception_ptr error;
+    };
+    boost::shared_ptr<Job> job;
+    mutex join_mutex;
+    thread worker;
+    void join() {
+        lock_guard<mutex> lock (join_mutex);
+        if (worker.joinable()) {
+            worker.join();
+        }
+        return;
+    };
+    BackgroundFit(const BackgroundFit&);
+    BackgroundFit& operator=(const BackgroundFit&);
+};
+
+// Runs a fit now, with the GIL released while it computes, or with
+// background on starts it and returns a BackgroundFit
+py::object runPyFit(PyFit* fit, bool background) {
+    if (background) {
+        return py::object(boost::shared_ptr<BackgroundFit> (new BackgroundFit(fit)));
+    }
+    unique_ptr<PyFit> owned (fit);
+    {
+        ReleaseGIL nogil;
+        fit->compute();
+    }
+    return fit->write();
+}
+
+py::object pyEMBasins(py::list nrnspiketimes, py::list nrnspiketimes_test, double binsize, int nbasins, int niter, string model, bool background) {
+// params,w,samples,state_hist,P,prob,logli,P_test = pyEMBasins(spiketimes, spiketimes_test, binsize, nbasins, niter, model='tree')
+// fit = pyEMBasins(..., background=True) returns at once; fit.done(), fit.cancel(), and fit.result() for the outputs above
  
 // nrnspiketimes is a list of lists, nNeurons x nSpikeTimes (# of spike times is different for each neuron, so not an array
 // binsize is the number of samples per bin, @ 10KHz sample rate and a 20ms bin, binsize=200
 // nbasins is number of modes, around 70 for the data in Prentice et al 2016 for HMM & TreeBasin
 // niter is the number of times EM is repeated
+// model is the basin model, 'tree' or 'independent' (spatial correlations on / off)
+// the GIL is released while fitting, so other Python threads keep running
 
     // https://www.boost.org/doc/libs/1_71_0/libs/python/doc/html/reference/index.html
     // see: https://www.boost.org/doc/libs/1_71_0/libs/python/doc/html/reference/object_wrappers/boost_python_list_hpp.html
@@ -425,70 +778,16 @@ py::list pyEMBasins(py::list nrnspiketimes, py::list nrnspiketimes_test, double
   
     cout << "Reading inputs..." << endl;
      
-    int N = len(nrnspiketimes); 
     vector<vector<double>> st = getSpikeTimes(nrnspiketimes);
     vector<vector<double>> st_test = getSpikeTimes(nrnspiketimes_test);
 
-    // Mixture model
-    cout << "Initializing EM..." << endl;
-    EMBasins<BasinType> basin_obj(st, st_test, binsize, nbasins);
-        
-    cout << "Training model..." << endl;
-    vector<double> logli;
-    vector<double> test_logli;
-    tie(logli,test_logli) = basin_obj.train(niter);
-    //vector<double> test_logli = basin_obj.test_logli;
-    
-    // Aditya modified: I've added testing at each iter in train()
-    //  so no need of testing at the end of training
-    //cout << "Testing..." << endl;
-    //vector<double> P_test;
-    //double logli_test;
-    // ::test() returns P_test as nbasins x nbins,
-    // unlike ::P_test() or P() which return nbasins x npatterns
-    //tie(P_test,logli_test) = basin_obj.test(st_test,binsize);
-    
-    vector<paramsStruct> params = basin_obj.basin_params();
-    int nstates = basin_obj.nstates();
-    int nstates_test = basin_obj.nstates_test();
-    cout << nstates << " states." << endl;
-    
-//    cout << "Getting samples..." << endl;
-    int nsamples = 100000;
-    vector<char> samples = basin_obj.sample(nsamples);
-
-    cout << "Writing outputs..." << endl;    
-    py::list outlist = py::list();
-    
-    // NOTE: python uses row-major order just like C/C++, and unlike matlab
-    // Thus, call as writePyOutputMatrix(Cmatrix, Crow, Ccolumn)
-    // unlike in the matlab bindings above, where Crow and Ccolumn are flipped    
-    outlist.append(writePyOutputStructDict(params));
-    outlist.append(writePyOutputMatrix(basin_obj.w,1,nbasins));
-    outlist.append(writePyOutputMatrix(samples,nsamples,N));
-    outlist.append(writePyOutputMatrix(basin_obj.word_list(),nstates,N));
-    outlist.append(writePyOutputMatrix(basin_obj.state_hist(),1,nstates));
-    outlist.append(writePyOutputMatrix(basin_obj.word_list_test(),nstates_test,N));
-    outlist.append(writePyOutputMatrix(basin_obj.test_hist(),1,nstates_test));
-    // P and P_test are the Qmodes/Z (cf. my MixtureModel.py calcModePosterior())
-    //  for each state in train_states and test_states
-    outlist.append(writePyOutputMatrix(basin_obj.P(),nstates,nbasins));
-    outlist.append(writePyOutputMatrix(basin_obj.P_test(),nstates_test,nbasins));
-    // all_prob and test_prob are the Z's for each state in train_states and test_states
-    outlist.append(writePyOutputMatrix(basin_obj.all_prob(),1,nstates));
-    outlist.append(writePyOutputMatrix(basin_obj.test_prob(),1,nstates_test));
-    outlist.append(writePyOutputMatrix(logli,1,niter));
-    outlist.append(writePyOutputMatrix(test_logli,1,niter));
-    //outlist.append(logli_test);
-   
-    // Aditya notes: P and P_test correspond to my Qmodes/Z (see MixtureModel.py calcModePosterior())
-    //  dim is nModes x nStates i.e. nbasins here x number of distinct states
-    // However, my Qmodes is nModes x ntimesteps
-    // Still, can use the state/pattern at each time step to choose its P from this matrix
-    // To calculate log likelihood, I need Z at each time step/bin!
-    //  (w.Qmodes)/Z != w.P = w.(Qmodes/Z) won't work because P is normalized sum=1 at each time step
-   
-    return outlist;
+    switch (basin_model_type(model)) {
+        case INDEPENDENT_BASIN:
+            return runPyFit(new EMBasinsFit<IndependentBasin>(st, st_test, binsize, nbasins, niter), background);
+        case TREE_BASIN:
+        default:
+            return runPyFit(new EMBasinsFit<TreeBasin>(st, st_test, binsize, nbasins, niter), background);
+    }
 }
 
 void pyInit() {
@@ -499,91 +798,500 @@ void pyInit() {
     cout << "Initialized python and numpy" << endl;
 }
 
-py::list pyHMM(py::list nrnspiketimes, np::ndarray & unobserved_edges_lo, np::ndarray & unobserved_edges_hi, double binsize, int nbasins, int niter) {
-// params,w,samples,state_hist,P,prob,logli,P_test = pyEMBasins(spiketimes, spiketimes_test, binsize, nbasins, niter)
+template <class BasinT>
+class HMMFit : public PyFit
+{
+public:
+    HMMFit(vector<vector<double> >& st, vector<double>& unobserved_edges_low, vector<double>& unobserved_edges_high, double binsize, int nbasins, int niter, bool path_only, int checkpoints) :
+        st (st), unobserved_edges_low (unobserved_edges_low), unobserved_edges_high (unobserved_edges_high), binsize (binsize), nbasins (nbasins), niter (niter), path_only (path_only), checkpoints (checkpoints) {};
+
+    void compute() {
+        // Hidden Markov model
+        basin_obj.reset(new HMM<BasinT>(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins));
+        basin_obj->set_checkpoints(checkpoints);
+        basin_obj->set_stop_flag(&stop);
+        tie(train_logli,test_logli) = basin_obj->train(niter);
+        if ((stopped = basin_obj->stop_requested())) {
+            return;
+        }
+        cout << "Viterbi..." << endl;
+        alpha = basin_obj->viterbi(true);
+        trans = basin_obj->get_trans();
+        if (path_only) {
+            // No posteriors, emissions or samples: only what the decoded path needs
+            cout << "Params..." << endl;
+            params = basin_obj->basin_params();
+            return;
+        }
+        cout << "P...." << endl;
+        P = basin_obj->get_P();
+        cout << "Pred prob..." << endl;
+        tie(pred_prob, hist) = basin_obj->pred_prob();
+//        vector<unsigned long> hist = basin_obj->state_hist();
+
+        cout << "Params..." << endl;
+        params = basin_obj->basin_params();
+        emiss_prob = basin_obj->emiss_prob();
+        //cout << "Microstates..." << endl;
+        // state_v_time() seg faults, see further notes in the function
+        //state_v_time = basin_obj->state_v_time();
+        samples = basin_obj->sample(nsamples);
+        stationary_prob = basin_obj->stationary_prob();
+    }
+
+    py::list write() {
+        int N = st.size();
+        if (path_only) {
+            py::list outlist = py::list();
+            outlist.append(writePyOutputStructDict(params));
+            outlist.append(writePyOutputMatrix(trans,nbasins,nbasins));
+            outlist.append(writePyOutputMatrix(alpha,1,alpha.size()));
+            outlist.append(writePyOutputMatrix(train_logli,1,niter));
+            outlist.append(writePyOutputMatrix(test_logli,1,niter));
+            cout << "Returning from C++!" << endl;
+            return outlist;
+        }
+        int T = floor(P.size() / nbasins);
+
+        cout << "Writing outputs..." << endl;
+        py::list outlist = py::list();
+
+        // NOTE: python uses row-major order just like C/C++, and unlike matlab
+        // Thus, call as writePyOutputMatrix(Cmatrix, Crow, Ccolumn)
+        // unlike in the matlab bindings above, where Crow and Ccolumn are flipped
+        outlist.append(writePyOutputStructDict(params));
+        outlist.append(writePyOutputMatrix(trans,nbasins,nbasins));
+        outlist.append(writePyOutputMatrix(P,T,nbasins));
+        outlist.append(writePyOutputMatrix(emiss_prob,T,nbasins));
+        //outlist.append(writePyOutputMatrix(state_v_time,1,T));
+        outlist.append(writePyOutputMatrix(alpha,1,T));
+        outlist.append(writePyOutputMatrix(pred_prob,1,pred_prob.size()));
+        outlist.append(writePyOutputMatrix(hist,1,hist.size()));
+        outlist.append(writePyOutputMatrix(samples,nsamples,N));
+        // don't return basin_obj->word_list(), I got python:free():invalid pointer error
+        //  sometimes on `return outlist` on the second call to pyHMM
+        //outlist.append(writePyOutputMatrix(basin_obj->word_list(),hist.size(),N));
+        outlist.append(writePyOutputMatrix(stationary_prob,1,nbasins));
+        outlist.append(writePyOutputMatrix(train_logli,1,niter));
+        outlist.append(writePyOutputMatrix(test_logli,1,niter));
+
+        cout << "Returning from C++!" << endl;
+        return outlist;
+    }
+private:
+    static const int nsamples = 100000;
+    vector<vector<double> > st;
+    vector<double> unobserved_edges_low;
+    vector<double> unobserved_edges_high;
+    double binsize;
+    int nbasins;
+    int niter;
+    bool path_only;
+    int checkpoints;
+
+    unique_ptr<HMM<BasinT> > basin_obj;          // Kept for params, which point into its basins
+    vector<double> train_logli;
+    vector<double> test_logli;
+    vector<int> alpha;
+    vector<paramsStruct> params;
+    vector<double> trans;
+    vector<double> P;
+    vector<double> pred_prob;
+    vector<double> hist;
+    vector<double> emiss_prob;
+    vector<char> samples;
+    vector<double> stationary_prob;
+};
+
+py::object pyHMM(py::list nrnspiketimes, np::ndarray & unobserved_edges_lo, np::ndarray & unobserved_edges_hi, double binsize, int nbasins, int niter, string model, string outputs, int checkpoints, bool background) {
+// params,trans,P,emiss_prob,alpha,pred_prob,hist,samples,stationary_prob,train_logli,test_logli = pyHMM(spiketimes, unobserved_lo, unobserved_hi, binsize, nbasins, niter, model='tree')
+// params,trans,alpha,train_logli,test_logli = pyHMM(..., outputs='path')
+// fit = pyHMM(..., background=True) returns at once; fit.done(), fit.cancel(), and fit.result() for the outputs above
  
 // nrnspiketimes is a list of lists, nNeurons x nSpikeTimes (# of spike times is different for each neuron, so not an array
 // binsize is the number of samples per bin, @ 10KHz sample rate and a 20ms bin, binsize=200
 // nbasins is number of modes, around 70 for the data in Prentice et al 2016 for HMM & TreeBasin
 // niter is the number of times EM is repeated
+// model is the basin model, 'tree' or 'independent' (spatial correlations on / off)
+// outputs is 'all', or 'path' for the decoded basin sequence without the per-bin outputs
+// checkpoints is the number of bins between forward-backward checkpoints (0: none, -1: sqrt(T))
+// the GIL is released while fitting, so other Python threads keep running
 
     // https://www.boost.org/doc/libs/1_71_0/libs/python/doc/html/reference/index.html
     // see: https://www.boost.org/doc/libs/1_71_0/libs/python/doc/html/reference/object_wrappers/boost_python_list_hpp.html
     //cout << py::len(st) << py::extract<double>(st[0]) << endl;
   
     cout << "Reading inputs..." << endl;
-    int N = len(nrnspiketimes);
     vector<vector<double>> st = getSpikeTimes(nrnspiketimes);
-    int n_unobserved_blocks = len(unobserved_edges_lo);
-    vector<double> unobserved_edges_low (n_unobserved_blocks);
-    vector<double> unobserved_edges_high (n_unobserved_blocks);
-    if (n_unobserved_blocks>0) {
-        unobserved_edges_low = getVec(unobserved_edges_lo);
-        unobserved_edges_high = getVec(unobserved_edges_hi);
+    vector<double> unobserved_edges_low;
+    vector<double> unobserved_edges_high;
+    getUnobservedEdges(unobserved_edges_lo, unobserved_edges_hi, unobserved_edges_low, unobserved_edges_high);
+
+    if (outputs != "all" && outputs != "path") {
+        throw invalid_argument("Unknown outputs '" + outputs + "': use 'all' or 'path'.");
+    }
+    bool path_only = (outputs == "path");
+    switch (basin_model_type(model)) {
+        case INDEPENDENT_BASIN:
+            return runPyFit(new HMMFit<IndependentBasin>(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins, niter, path_only, checkpoints), background);
+        case TREE_BASIN:
+        default:
+            return runPyFit(new HMMFit<TreeBasin>(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins, niter, path_only, checkpoints), background);
     }
+}
 
-    // Hidden Markov model
-    HMM<BasinType> basin_obj(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins);
-    vector<double> train_logli;
-    vector<double> test_logli;
-    tie(train_logli,test_logli) = basin_obj.train(niter);
-    cout << "Viterbi..." << endl;
-    vector<int> alpha = basin_obj.viterbi(true);
-    cout << "P...." << endl;
-    vector<double> P = basin_obj.get_P();
-    cout << "Pred prob..." << endl;
-    pair<vector<double>, vector<double> > tmp = basin_obj.pred_prob();
-    vector<double> pred_prob = tmp.first;
-    vector<double> hist = tmp.second;
-//    vector<unsigned long> hist = basin_obj.state_hist();
-    int T = floor(P.size() / nbasins);
+template <class BasinT>
+class AutocorrFit : public PyFit
+{
+public:
+    AutocorrFit(vector<vector<double> >& st, double binsize, int nbasins, int niter) :
+        st (st), binsize (binsize), nbasins (nbasins), niter (niter) {};
+
+    void compute() {
+        // Autocorrelation model
+        basin_obj.reset(new Autocorr<BasinT>(st, binsize, nbasins));
+        basin_obj->set_stop_flag(&stop);
+        logli = basin_obj->train(niter);
+        if ((stopped = basin_obj->stop_requested())) {
+            return;
+        }
+        cout << "Viterbi..." << endl;
+        alpha = basin_obj->viterbi();
+
+        cout << "Params..." << endl;
+        params = basin_obj->basin_params();
+        forward = basin_obj->get_forward();
+        backward = basin_obj->get_backward();
+        basin_trans = basin_obj->get_basin_trans();
+        P_indep = basin_obj->P_indep();
+    }
 
-    cout << "Params..." << endl;
-    vector<paramsStruct> params = basin_obj.basin_params();
+    py::list write() {
+        int N = st.size();
+        int T = alpha.size();
+
+        cout << "Writing outputs..." << endl;
+        py::list outlist = py::list();
+        outlist.append(writePyOutputMatrix(logli,1,niter));
+        outlist.append(writePyOutputMatrix(alpha,1,T));
+        outlist.append(writePyOutputStructDict(params));
+        outlist.append(writePyOutputMatrix(forward,T,nbasins));
+        outlist.append(writePyOutputMatrix(backward,T,nbasins));
+        outlist.append(writePyOutputMatrix(basin_trans,nbasins,4*N));
+        outlist.append(writePyOutputMatrix(basin_obj->w,1,nbasins));
+        outlist.append(writePyOutputMatrix(P_indep,T,nbasins));
+        return outlist;
+    }
+private:
+    vector<vector<double> > st;
+    double binsize;
+    int nbasins;
+    int niter;
 
-    cout << "Writing outputs..." << endl;
-    py::list outlist = py::list();
+    unique_ptr<Autocorr<BasinT> > basin_obj;     // Kept for params, which point into its basins
+    vector<double> logli;
+    vector<int> alpha;
+    vector<paramsStruct> params;
+    vector<double> forward;
+    vector<double> backward;
+    vector<double> basin_trans;
+    vector<double> P_indep;
+};
 
-    // NOTE: python uses row-major order just like C/C++, and unlike matlab
-    // Thus, call as writePyOutputMatrix(Cmatrix, Crow, Ccolumn)
-    // unlike in the matlab bindings above, where Crow and Ccolumn are flipped    
-    outlist.append(writePyOutputStructDict(params));
-    outlist.append(writePyOutputMatrix(basin_obj.get_trans(),nbasins,nbasins));
-    outlist.append(writePyOutputMatrix(P,T,nbasins));
-    outlist.append(writePyOutputMatrix(basin_obj.emiss_prob(),T,nbasins));
-    //cout << "Microstates..." << endl;
-    // state_v_time() seg faults, see further notes in the function
-    //outlist.append(writePyOutputMatrix(basin_obj.state_v_time(),1,T));
-    outlist.append(writePyOutputMatrix(alpha,1,T));
-    outlist.append(writePyOutputMatrix(pred_prob,1,pred_prob.size()));
-    outlist.append(writePyOutputMatrix(hist,1,hist.size()));
-    outlist.append(writePyOutputMatrix(basin_obj.sample(100000),100000,N));
-    // don't return basin_obj.word_list(), I got python:free():invalid pointer error
-    //  sometimes on `return outlist` on the second call to pyHMM
-    //outlist.append(writePyOutputMatrix(basin_obj.word_list(),hist.size(),N));
-    outlist.append(writePyOutputMatrix(basin_obj.stationary_prob(),1,nbasins));
-    outlist.append(writePyOutputMatrix(train_logli,1,niter));
-    outlist.append(writePyOutputMatrix(test_logli,1,niter));
-   
-    cout << "Returning from C++!" << endl;
-    return outlist;
-}
+py::object pyAutocorr(py::list nrnspiketimes, double binsize, int nbasins, int niter, string model, bool background) {
+// logli,alpha,params,forward,backward,basin_trans,w,P_indep = pyAutocorr(spiketimes, binsize, nbasins, niter, model='tree')
+// Autocorrelation model: each mode additionally carries per-neuron spike autocorrelations
+// arguments as for pyHMM, without held-out blocks
 
-BOOST_PYTHON_MODULE(EMBasins)
-{
-   using namespace boost::python;
-   def("pyEMBasins",pyEMBasins);
-   def("pyHMM",pyHMM);
-   def("pyInit",pyInit);
+    cout << "Reading inputs..." << endl;
+    vector<vector<double>> st = getSpikeTimes(nrnspiketimes);
+
+    switch (basin_model_type(model)) {
+        case INDEPENDENT_BASIN:
+            return runPyFit(new AutocorrFit<IndependentBasin>(st, binsize, nbasins, niter), background);
+        case TREE_BASIN:
+        default:
+            return runPyFit(new AutocorrFit<TreeBasin>(st, binsize, nbasins, niter), background);
+    }
 }
 
-#endif
+// Persistent HMM for Python: the binned data, emission tables and fitted
+// parameters stay in one C++ object between calls, so the model can be
+// trained further, decoded, scored on new recordings and sampled without
+// re-reading the spikes. Like the one-shot bindings, every call releases the
+// GIL while it computes; calls on the same model run one at a time.
+class PyHMMModel
+{
+public:
+    virtual ~PyHMMModel() {};
+    virtual py::list fit(int niter) = 0;
+    virtual py::list partial_fit(int niter) = 0;
+    virtual double score(py::list nrnspiketimes, double duration) = 0;
+    virtual np::ndarray decode(py::object nrnspiketimes, double duration) = 0;
+    virtual np::ndarray posteriors(py::object nrnspiketimes, double duration) = 0;
+    virtual np::ndarray sample(int nsamples) = 0;
+    virtual py::dict params() = 0;
+};
 
-RNG::RNG() {
-    // Initialize mersenne twister RNG
+template <class BasinT>
+class HMMModel : public PyHMMModel
+{
+public:
+    HMMModel(vector<vector<double> >& st, vector<double>& unobserved_edges_low, vector<double>& unobserved_edges_high, double binsize, int nbasins, int checkpoints) :
+        N (st.size()), nbasins (nbasins), binsize (binsize), fitted (false) {
+        ReleaseGIL nogil;
+        basin_obj.reset(new HMM<BasinT>(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins));
+        basin_obj->set_checkpoints(checkpoints);
+    };
+
+    py::list fit(int niter) {
+        // Fresh parameters, then niter EM iterations
+        vector<double> train_logli;
+        vector<double> test_logli;
+        {
+            ReleaseGIL nogil;
+            lock_guard<mutex> lock (busy);
+            tie(train_logli,test_logli) = basin_obj->train(niter);
+            fitted = true;
+        }
+        return write_logli(train_logli, test_logli);
+    }
+
+    py::list partial_fit(int niter) {
+        // niter more EM iterations from the current parameters
+        vector<double> train_logli;
+        vector<double> test_logli;
+        {
+            ReleaseGIL nogil;
+            lock_guard<mutex> lock (busy);
+            tie(train_logli,test_logli) = basin_obj->resume_train(niter);
+            fitted = true;
+        }
+        return write_logli(train_logli, test_logli);
+    }
+
+    double score(py::list nrnspiketimes, double duration) {
+        return score_recording(nrnspiketimes, duration, false).logli;
+    }
+
+    np::ndarray decode(py::object nrnspiketimes, double duration) {
+        vector<int> alpha;
+        if (nrnspiketimes.is_none()) {
+            check_trained();
+            ReleaseGIL nogil;
+            lock_guard<mutex> lock (busy);
+            alpha = basin_obj->viterbi(true);
+        } else {
+            alpha = score_recording(py::extract<py::list>(nrnspiketimes), duration, false).path;
+        }
+        return writePyOutputMatrix(alpha,1,alpha.size());
+    }
+
+    np::ndarray posteriors(py::object nrnspiketimes, double duration) {
+        vector<double> P;
+        if (nrnspiketimes.is_none()) {
+            check_trained();
+            ReleaseGIL nogil;
+            lock_guard<mutex> lock (busy);
+            P = basin_obj->get_P();
+        } else {
+            P = score_recording(py::extract<py::list>(nrnspiketimes), duration, true).P;
+        }
+        return writePyOutputMatrix(P,P.size()/nbasins,nbasins);
+    }
+
+    np::ndarray sample(int nsamples) {
+        check_trained();
+        vector<char> samples;
+        {
+            ReleaseGIL nogil;
+            lock_guard<mutex> lock (busy);
+            samples = basin_obj->sample(nsamples);
+        }
+        return writePyOutputMatrix(samples,nsamples,N);
+    }
+
+    py::dict params() {
+        check_trained();
+        // The paramsStructs point into the basins, which a later fit() may
+        // free: their data is copied before the lock is released
+        vector<vector<ParamsField> > basin_params;
+        vector<double> trans;
+        vector<double> stationary_prob;
+        {
+            ReleaseGIL nogil;
+            lock_guard<mutex> lock (busy);
+            vector<paramsStruct> params = basin_obj->basin_params();
+            basin_params = copyParams(params);
+            trans = basin_obj->get_trans();
+            stationary_prob = basin_obj->stationary_prob();
+        }
+        py::dict out;
+        out["basins"] = writePyOutputStructDict(basin_params);
+        out["trans"] = writePyOutputMatrix(trans,nbasins,nbasins);
+        out["stationary_prob"] = writePyOutputMatrix(stationary_prob,1,nbasins);
+        return out;
+    }
+private:
+    int N;
+    int nbasins;
+    double binsize;
+    unique_ptr<HMM<BasinT> > basin_obj;
+    mutex busy;
+    atomic<bool> fitted;
+
+    void check_trained() {
+        if (!fitted) {
+            throw runtime_error("The model has not been fitted: call fit() first.");
+        }
+        return;
+    }
+
+    py::list write_logli(vector<double>& train_logli, vector<double>& test_logli) {
+        py::list outlist = py::list();
+        outlist.append(writePyOutputMatrix(train_logli,1,train_logli.size()));
+        outlist.append(writePyOutputMatrix(test_logli,1,test_logli.size()));
+        return outlist;
+    }
+
+    HMMScore score_recording(py::list nrnspiketimes, double duration, bool posteriors) {
+        // One new recording through HMM::score(); duration <= 0 scores up
+        // to the bin of the last spike
+        check_trained();
+        vector<vector<vector<double> > > recordings (1, getSpikeTimes(nrnspiketimes));
+        if (recordings[0].size() != N) {
+            throw invalid_argument("nrnspiketimes must have one entry per neuron of the model.");
+        }
+        if (duration <= 0) {
+            double last = 0;
+            for (int n=0; n<N; n++) {
+                for (int i=0; i<recordings[0][n].size(); i++) {
+                    last = max(last, recordings[0][n][i]);
+                }
+            }
+            duration = (floor(last / binsize) + 1) * binsize;
+        }
+        vector<double> durations (1, duration);
+        ReleaseGIL nogil;
+        lock_guard<mutex> lock (busy);
+        return basin_obj->score(recordings, durations, binsize, posteriors, 1)[0];
+    }
+};
+
+boost::shared_ptr<PyHMMModel> makePyHMMModel(py::list nrnspiketimes, np::ndarray & unobserved_edges_lo, np::ndarray & unobserved_edges_hi, double binsize, int nbasins, string model, int checkpoints) {
+// model = HMMModel(spiketimes, unobserved_lo, unobserved_hi, binsize, nbasins, model='tree', checkpoints=0)
+// train_logli,test_logli = model.fit(niter)           (fresh parameters)
+// train_logli,test_logli = model.partial_fit(niter)   (more iterations from the current ones)
+// logli = model.score(spiketimes, duration=0)         log P(new recording); duration 0: up to the last spike
+// alpha = model.decode(spiketimes=None, duration=0)   Viterbi path, of the training data by default
+// P = model.posteriors(spiketimes=None, duration=0)   T x nbasins mode posteriors, likewise
+// samples = model.sample(nsamples)
+// params = model.params()                             dict of basins, trans and stationary_prob
+// arguments as for pyHMM
+
+    // The methods return numpy arrays: initialise numpy here, as pyEMBasins does
+    Py_Initialize();
+    np::initialize();
+
+    cout << "Reading inputs..." << endl;
+    vector<vector<double>> st = getSpikeTimes(nrnspiketimes);
+    vector<double> unobserved_edges_low;
+    vector<double> unobserved_edges_high;
+    getUnobservedEdges(unobserved_edges_lo, unobserved_edges_hi, unobserved_edges_low, unobserved_edges_high);
+
+    switch (basin_model_type(model)) {
+        case INDEPENDENT_BASIN:
+            return boost::shared_ptr<PyHMMModel> (new HMMModel<IndependentBasin>(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins, checkpoints));
+        case TREE_BASIN:
+        default:
+            return boost::shared_ptr<PyHMMModel> (new HMMModel<TreeBasin>(st, unobserved_edges_low, unobserved_edges_high, binsize, nbasins, checkpoints));
+    }
+}
+
+py::list pyMarkov(np::ndarray & trans, np::ndarray & start, double eps) {
+// stationary_prob,spectral_gap,mixing_time = pyMarkov(trans, start, eps=0.25)
+// Long-run summaries of a K x K transition matrix, e.g. trans from pyHMM:
+// stationary_prob is the long-run limit started from start (empty: uniform),
+// spectral_gap is 1 - |lambda_2|, and mixing_time the number of steps until
+// every starting mode is within eps of stationary_prob in total variation (-1: never)
+
+    int K = trans.shape(0);
+    if (trans.get_nd() != 2 || trans.shape(1) != K) {
+        throw invalid_argument("trans must be a square matrix.");
+    }
+    vector<double> P (K*K);
+    for (int i=0; i<K; i++) {
+        for (int j=0; j<K; j++) {
+            P[i*K+j] = py::extract<double>(trans[i][j]);
+        }
+    }
+    vector<double> w (K, 1.0/K);
+    if (len(start) > 0) {
+        if (len(start) != K) {
+            throw invalid_argument("start must have one entry per row of trans.");
+        }
+        for (int i=0; i<K; i++) {
+            w[i] = py::extract<double>(start[i]);
+        }
+    }
+
+    vector<double> pi = markov_stationary(P.data(), w.data(), K);
+    py::list outlist = py::list();
+    outlist.append(writePyOutputMatrix(pi,1,K));
+    outlist.append(1 - markov_second_eigenvalue(P.data(), pi.data(), K));
+    outlist.append(markov_mixing_time(P.data(), pi.data(), K, eps));
+    return outlist;
+}
+
+BOOST_PYTHON_MODULE(EMBasins)
+{
+   using namespace boost::python;
+   class_<BackgroundFit, boost::shared_ptr<BackgroundFit>, boost::noncopyable>("BackgroundFit", no_init)
+       .def("done",&BackgroundFit::done)
+       .def("cancel",&BackgroundFit::cancel)
+       .def("result",&BackgroundFit::result);
+   def("pyEMBasins",pyEMBasins,
+       (py::arg("nrnspiketimes"), py::arg("nrnspiketimes_test"), py::arg("binsize"), py::arg("nbasins"), py::arg("niter"), py::arg("model")="tree",
+        py::arg("background")=false));
+   def("pyHMM",pyHMM,
+       (py::arg("nrnspiketimes"), py::arg("unobserved_edges_lo"), py::arg("unobserved_edges_hi"), py::arg("binsize"), py::arg("nbasins"), py::arg("niter"), py::arg("model")="tree",
+        py::arg("outputs")="all", py::arg("checkpoints")=0, py::arg("background")=false));
+   def("pyAutocorr",pyAutocorr,
+       (py::arg("nrnspiketimes"), py::arg("binsize"), py::arg("nbasins"), py::arg("niter"), py::arg("model")="tree",
+        py::arg("background")=false));
+   class_<PyHMMModel, boost::shared_ptr<PyHMMModel>, boost::noncopyable>("HMMModel", no_init)
+       .def("__init__",make_constructor(&makePyHMMModel, default_call_policies(),
+            (py::arg("nrnspiketimes"), py::arg("unobserved_edges_lo"), py::arg("unobserved_edges_hi"), py::arg("binsize"), py::arg("nbasins"), py::arg("model")="tree",
+             py::arg("checkpoints")=0)))
+       .def("fit",&PyHMMModel::fit,(py::arg("niter")))
+       .def("partial_fit",&PyHMMModel::partial_fit,(py::arg("niter")))
+       .def("score",&PyHMMModel::score,(py::arg("nrnspiketimes"), py::arg("duration")=0.0))
+       .def("decode",&PyHMMModel::decode,(py::arg("nrnspiketimes")=py::object(), py::arg("duration")=0.0))
+       .def("posteriors",&PyHMMModel::posteriors,(py::arg("nrnspiketimes")=py::object(), py::arg("duration")=0.0))
+       .def("sample",&PyHMMModel::sample,(py::arg("nsamples")))
+       .def("params",&PyHMMModel::params);
+   def("pyMarkov",pyMarkov,
+       (py::arg("trans"), py::arg("start"), py::arg("eps")=0.25));
+   def("pyInit",pyInit);
+}
+
+#endif
+
+RNG::RNG() {
+    // Initialize mersenne twister RNG
     rng_pr = gsl_rng_alloc(gsl_rng_mt19937);
 
 }
+RNG::RNG(unsigned long seed, unsigned long stream) {
+    // Mersenne twister seeded by a splitmix64 hash of (seed, stream), so that
+    // consecutive stream indices give decorrelated sequences
+    unsigned long long z = (unsigned long long) seed + 0x9E3779B97F4A7C15ULL * ((unsigned long long) stream + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    rng_pr = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(rng_pr, (unsigned long) (z & 0xffffffffUL));
+}
 RNG::~RNG() {
     gsl_rng_free(rng_pr);
 }
@@ -600,6 +1308,56 @@ int RNG::discrete(const vector<double>& p) {
 bool RNG::bernoulli(double p) {
     return (gsl_rng_uniform(rng_pr) < p);
 }
+double RNG::uniform() {
+    return gsl_rng_uniform(rng_pr);
+}
+unsigned long RNG::get() {
+    return gsl_rng_get(rng_pr);
+}
+
+AliasTable::AliasTable(const double* p, int n) : prob(n), alias(n) {
+    // Vose's method: split the scaled probabilities into under- and
+    // over-full columns and pair each under-full column with an alias.
+    double total = 0;
+    for (int i=0; i<n; i++) {
+        total += p[i];
+    }
+    vector<double> scaled (n);
+    vector<int> small, large;
+    for (int i=0; i<n; i++) {
+        scaled[i] = p[i] * n / total;
+        if (scaled[i] < 1) {
+            small.push_back(i);
+        } else {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(); small.pop_back();
+        int l = large.back();
+        prob[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] -= (1 - scaled[s]);
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Leftovers are full columns up to rounding
+    for (int i=0; i<large.size(); i++) {
+        prob[large[i]] = 1;
+        alias[large[i]] = large[i];
+    }
+    for (int i=0; i<small.size(); i++) {
+        prob[small[i]] = 1;
+        alias[small[i]] = small[i];
+    }
+}
+int AliasTable::draw(RNG& rng) const {
+    double u = rng.uniform() * prob.size();
+    int i = (int) u;
+    return (u - i < prob[i]) ? i : alias[i];
+}
 
 vector<int> RNG::randperm(int nmax) {
     vector<int> nvals (nmax);
@@ -618,21 +1376,23 @@ vector<int> RNG::randperm(int nmax) {
 }
 
 template <class BasinT>
-EMBasins<BasinT>::EMBasins(int N, int nbasins) : N(N), nbasins(nbasins), w(nbasins) {
+EMBasins<BasinT>::EMBasins(int N, int nbasins) : N(N), nbasins(nbasins), w(nbasins), model_version(0), stop_flag(NULL) {
     rng = new RNG();
-    //srand(time(NULL));
-    srand(0);
+    word_width = word_kernel_width(N);
+    // Basins are initialised from rng, not the process-wide rand(), so
+    // concurrent fits do not share (or reseed) one stream
 }
 
 
 template <class BasinT>
-EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& st_test, double binsize, int nbasins) : nbasins(nbasins), nsamples(0), w(nbasins) {
+EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& st_test, double binsize, int nbasins) : nbasins(nbasins), nsamples(0), w(nbasins), model_version(0), stop_flag(NULL) {
     
     rng = new RNG();
     
     N = st.size();
-    //srand(time(NULL));
-    srand(0);
+    word_width = word_kernel_width(N);
+    // Basins are initialised from rng, not the process-wide rand(), so
+    // concurrent fits do not share (or reseed) one stream
 
     
     // Build state structure from spike times in st:
@@ -641,17 +1401,18 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
     
     vector<Spike> all_spikes = sort_spikes(st, binsize);
     
-    string silent_str (N,'0');
+    int nlanes = word_nlanes(N);
+    word_key silent_key (nlanes, 0);
 
     // Add silent state with frequency of zero
     State this_state;
-    string this_str = silent_str;
+    word_key this_key = silent_key;
     this_state.freq = 0;
     this_state.P.assign(nbasins, 0);
     this_state.weight.assign(nbasins, 0);
     this_state.word.assign(N,0);
-    all_states.insert(pair<string,State> (silent_str,this_state));
-    test_states.insert(pair<string,State> (silent_str,this_state));
+    state_iter silent = all_states.insert(pair<word_key,State> (silent_key,this_state)).first;
+    state_iter test_silent = test_states.insert(pair<word_key,State> (silent_key,this_state)).first;
     
     int curr_bin = 0;
     for (vector<Spike>::iterator it=all_spikes.begin(); it!=all_spikes.end(); ++it) {
@@ -663,22 +1424,20 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
             // Add new state; if it's already been discovered increment its frequency
             this_state.active_constraints = BasinT::get_active_constraints(this_state);
 
-            raster.push_back(this_str);
+            raster.insert(raster.end(), this_key.begin(), this_key.end());
             
             
-            pair<state_iter, bool> ins = all_states.insert(pair<string,State> (this_str,this_state));
+            pair<state_iter, bool> ins = all_states.insert(pair<word_key,State> (this_key,this_state));
             if (!ins.second) {
                 (((ins.first)->second).freq)++;
             }
             
             // All states between curr_bin and next_bin (exclusive) are silent; update frequency of silent state accordingly
-            for (int i=0; i<(next_bin-curr_bin-1); i++) {
-                raster.push_back(silent_str);
-            }
-            all_states[silent_str].freq += (next_bin - curr_bin - 1);
+            raster.resize(raster.size() + (long) (next_bin-curr_bin-1)*nlanes, 0);
+            (silent->second).freq += (next_bin - curr_bin - 1);
         
             // Reset state and jump to next bin
-            this_str = silent_str;
+            this_key = silent_key;
             this_state.freq = 1;
             this_state.on_neurons.clear();
             this_state.P.assign(nbasins,0);
@@ -690,7 +1449,7 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
         
         // Add next_cell to this_state
         if (this_state.word[next_cell] == 0) {  // Don't want to count a cell twice in one bin
-            this_str[next_cell] = '1';
+            set_word_bit(this_key, next_cell);
             this_state.on_neurons.push_back(next_cell);
             this_state.word[next_cell] = 1;
         }
@@ -700,18 +1459,19 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
     // Aditya notes: the very last state doesn't get added above, so add it at the end
     // Add new state; if it's already been discovered increment its frequency
     this_state.active_constraints = BasinT::get_active_constraints(this_state);
-    raster.push_back(this_str);
-    pair<state_iter, bool> ins = all_states.insert(pair<string,State> (this_str,this_state));
+    raster.insert(raster.end(), this_key.begin(), this_key.end());
+    pair<state_iter, bool> ins = all_states.insert(pair<word_key,State> (this_key,this_state));
     if (!ins.second) {
         (((ins.first)->second).freq)++;
     }
 
     // if silent state was not present, remove it
-    if (all_states[silent_str].freq == 0) {
-        all_states.erase(silent_str);
+    if ((silent->second).freq == 0) {
+        all_states.erase(silent);
     }
     
     // Now all_states contains all distinct states in the training data together with their frequencies.
+    pack_states(all_states);
     
     for (state_iter it=all_states.begin(); it!=all_states.end(); ++it) {
         nsamples += (it->second).freq;
@@ -725,7 +1485,7 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
     vector<Spike> test_spikes = sort_spikes(st_test,binsize);
 
     // Add silent state with frequency of zero
-    this_str = silent_str;
+    this_key = silent_key;
     this_state.freq = 0;
     this_state.on_neurons.clear();
     this_state.P.assign(nbasins, 0);
@@ -741,18 +1501,18 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
         if (next_bin > curr_bin) {
             // Add new state; if it's already been discovered increment its frequency
             this_state.active_constraints = BasinT::get_active_constraints(this_state);
-            pair<state_iter, bool> ins = test_states.insert(pair<string,State> (this_str,this_state));
+            pair<state_iter, bool> ins = test_states.insert(pair<word_key,State> (this_key,this_state));
             if (!ins.second) {
                 (((ins.first)->second).freq)++;
             }
             
             // All states between curr_bin and next_bin (exclusive) are silent; update frequency of silent state accordingly
-            test_states[silent_str].freq += (next_bin - curr_bin - 1);
+            (test_silent->second).freq += (next_bin - curr_bin - 1);
             
             // unlike for the train bins above, the test bins are not pushed to 'raster'
             
             // Reset state and jump to next bin
-            this_str = silent_str;
+            this_key = silent_key;
             this_state.freq = 1;
             this_state.on_neurons.clear();
             this_state.P.assign(nbasins,0);
@@ -764,7 +1524,7 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
         
         // Add next_cell to this_state
         if (this_state.word[next_cell] == 0) {  // Don't want to count a cell twice in one bin
-            this_str[next_cell] = '1';
+            set_word_bit(this_key, next_cell);
             this_state.on_neurons.push_back(next_cell);
             this_state.word[next_cell] = 1;
         }
@@ -774,16 +1534,17 @@ EMBasins<BasinT>::EMBasins(vector<vector<double>>& st, vector<vector<double>>& s
     // Aditya notes: the very last state doesn't get added above, so add it at the end
     // Add new state; if it's already been discovered increment its frequency
     this_state.active_constraints = BasinT::get_active_constraints(this_state);
-    raster.push_back(this_str);
-    ins = test_states.insert(pair<string,State> (this_str,this_state));
+    raster.insert(raster.end(), this_key.begin(), this_key.end());
+    ins = test_states.insert(pair<word_key,State> (this_key,this_state));
     if (!ins.second) {
         (((ins.first)->second).freq)++;
     }
 
     // if silent state was not present above, remove it
-    if (test_states[silent_str].freq == 0) {
-        test_states.erase(silent_str);
+    if ((test_silent->second).freq == 0) {
+        test_states.erase(test_silent);
     }
+    pack_states(test_states);
 
     // Aditya added ends
 
@@ -802,21 +1563,44 @@ tuple<vector<double>,double> EMBasins<BasinT>::test(const vector<vector<double>
     int max_bin = all_spikes.back().bin;
     
     vector<double> P_test(nbasins*max_bin);
-    map<string, State> eval_states;
-    
+    test_mode.assign(max_bin, 0);
+    word_cache.sync(model_version, w);
     
-    string silent_str (N,'0');
+    // Distinct words of the recording, indexed by their packed bits, with the
+    // MAP mode of each: a bin costs its spikes plus one hash lookup, and only
+    // a word seen for the first time goes through word_cache
+    int nlanes = word_nlanes(N);
+    unordered_map<word_key, int, WordHash> eval_index;
+    vector<State> eval_states;
+    vector<int> eval_mode;
+    auto eval_word = [&](const word_key& key) -> int {
+        pair<unordered_map<word_key, int, WordHash>::iterator, bool> ins = eval_index.insert(make_pair(key, (int) eval_states.size()));
+        if (ins.second) {
+            State this_state;
+            this_state.freq = 0;
+            this_state.P.assign(nbasins, 0);
+            this_state.weight.assign(nbasins,0);
+            this_state.word.assign(N,0);
+            this_state.bits = key;
+            for_each_on<0>(key.data(), nlanes, [&](int n) {
+                this_state.on_neurons.push_back(n);
+                this_state.word[n] = 1;
+            });
+            this_state.active_constraints = BasinT::get_active_constraints(this_state);
+            // Aditya notes: set_state_P sets this_state.P[i]
+            //  to Qmodes[i,next_bin]/Z (see MixtureModel.py calcModePosterior())
+            //  where i indexes modes, and this_state occurs in next_bin
+            // (cached_state_P: the same, looked up first in word_cache)
+            eval_mode.push_back(cached_state_P(this_state));
+            eval_states.push_back(this_state);
+        }
+        return ins.first->second;
+    };
     
     // Add silent state with frequency of zero
-    State this_state;
-    string this_str = silent_str;
-    this_state.freq = 0;
-    this_state.P.assign(nbasins, 0);
-    this_state.weight.assign(nbasins,0);
-    this_state.word.assign(N,0);
-
-    set_state_P(this_state);
-    eval_states.insert(pair<string,State> (silent_str,this_state));
+    word_key silent_key (nlanes, 0);
+    word_key this_key = silent_key;
+    int silent = eval_word(silent_key);
     
     int curr_bin = 0;
     for (vector<Spike>::iterator it=all_spikes.begin(); it!=all_spikes.end(); ++it) {
@@ -826,66 +1610,58 @@ tuple<vector<double>,double> EMBasins<BasinT>::test(const vector<vector<double>
         
         if (next_bin > curr_bin) {
             // Add new state; if it's already been discovered increment its frequency
-            this_state.active_constraints = BasinT::get_active_constraints(this_state);
-            // Aditya notes: set_state_P sets this_state.P[i]
-            //  to Qmodes[i,next_bin]/Z (see MixtureModel.py calcModePosterior())
-            //  where i indexes modes, and this_state occurs in next_bin
-            set_state_P(this_state);
-            pair<state_iter, bool> ins = eval_states.insert(pair<string,State> (this_str,this_state));
-            if (!ins.second) {
-                (((ins.first)->second).freq)++;
-            }
-            
+            int found = eval_word(this_key);
+            (eval_states[found].freq)++;
             
             // Update probabilities of time bins [curr_bin, next_bin)
             for (int i=0; i<nbasins; i++) {
                 // Aditya notes: P_test is Qmodes/Z for this state/bin
-                P_test[nbasins*curr_bin + i] = this_state.P[i];
+                P_test[nbasins*curr_bin + i] = eval_states[found].P[i];
                 for (int n=curr_bin+1; n<next_bin; n++) {
                     // Aditya notes: all states between curr_bin and next_bin are silent states,
                     //  set P_test for these intermediate bins to Qmodes/Z for the silent state
-                    P_test[nbasins*n + i] = eval_states[silent_str].P[i];
+                    P_test[nbasins*n + i] = eval_states[silent].P[i];
                 }
             }
+            test_mode[curr_bin] = eval_mode[found];
+            for (int n=curr_bin+1; n<next_bin; n++) {
+                test_mode[n] = eval_mode[silent];
+            }
             
             // All states between curr_bin and next_bin (exclusive) are silent; update frequency of silent state accordingly
-            eval_states[silent_str].freq += (next_bin - curr_bin - 1);
+            eval_states[silent].freq += (next_bin - curr_bin - 1);
             
             
             // Reset state and jump to next bin
-            this_str = silent_str;
-            this_state.freq = 1;
-            this_state.on_neurons.clear();
-            this_state.P.assign(nbasins,0);
-            this_state.weight.assign(nbasins,0);
-            this_state.word.assign(N,0);
+            this_key = silent_key;
             
             curr_bin = next_bin;
         }
         
-        // Add next_cell to this_state
-        if (this_state.word[next_cell] == 0) {  // Don't want to count a cell twice in one bin
-            this_str[next_cell] = '1';
-            this_state.on_neurons.push_back(next_cell);
-            this_state.word[next_cell] = 1;
-        }
+        // Add next_cell to this_state (a cell spiking twice in one bin sets the same bit)
+        set_word_bit(this_key, next_cell);
         
     }
-    // Aditya modified begins
-    //if (all_states[silent_str].freq == 0) {
-    //    all_states.erase(silent_str);
-    //}
-    // should be eval_states, not all_states I think
-    if (eval_states[silent_str].freq == 0) {
-        eval_states.erase(silent_str);
-    }
-    // Aditya modifed ends
     
     // Aditya modified begins
     //return P_test;
     
-    test_states = eval_states;
-    test_logli = update_P_test();
+    // The posteriors are already in place (cached_state_P), only the
+    // weights need the final frequencies. The silent state is dropped if
+    // it never occurred.
+    test_states.clear();
+    int nwords = eval_states.size();
+    for (int s=0; s<nwords; s++) {
+        State& this_state = eval_states[s];
+        if (s == silent && this_state.freq == 0) {
+            continue;
+        }
+        for (int i=0; i<nbasins; i++) {
+            this_state.weight[i] = this_state.freq * this_state.P[i];
+        }
+        test_states.insert(pair<word_key,State> (this_state.bits, this_state));
+    }
+    double test_logli = test_states_logli();
     return make_tuple(P_test,test_logli);
     // Aditya modified ends
 }
@@ -893,28 +1669,30 @@ tuple<vector<double>,double> EMBasins<BasinT>::test(const vector<vector<double>
 
 template <class BasinT>
 vector<double> EMBasins<BasinT>::crossval(int niter, int k) {
-    int blocksize = floor(raster.size() / k);
+    int nlanes = word_nlanes(N);
+    int nbins = raster.size() / nlanes;
+    int blocksize = floor(nbins / k);
     // Generate random permutation of time bins
-    vector<int> tperm = rng->randperm(raster.size());
+    vector<int> tperm = rng->randperm(nbins);
     vector<double> all_logli (k*niter);
     for (int i=0; i<k; i++) {
     //    populate train_states and test_states
         train_states.clear();
         test_states.clear();
         for (int t=0; t<tperm.size(); t++) {
-            string this_str = raster[tperm[t]];
-            State this_state = all_states[this_str];
+            word_key this_key (raster.begin() + (long) tperm[t]*nlanes, raster.begin() + (long) (tperm[t]+1)*nlanes);
+            State this_state = all_states[this_key];
             this_state.freq = 1;
-            map<string, State>& curr_map = (t < i*blocksize || t >= (i+1)*blocksize)
+            state_map& curr_map = (t < i*blocksize || t >= (i+1)*blocksize)
                                             ? train_states : test_states;
-            pair<state_iter, bool> ins = curr_map.insert(pair<string,State> (this_str,this_state));
+            pair<state_iter, bool> ins = curr_map.insert(pair<word_key,State> (this_key,this_state));
             if (!ins.second) {
                 (((ins.first)->second).freq)++;
             }
         }
         
     //    train (returns logli of test set)
-        vector<double> logli = train(niter);
+        vector<double> logli = get<1>(train(niter));
         for (int j=0; j<niter; j++) {
             all_logli[i*niter + j] = logli[j];
         }
@@ -934,26 +1712,29 @@ tuple< vector<double>, vector<double> > EMBasins<BasinT>::train(int niter) {
         //        BasinT this_basin  BasinT(N));
         basins.push_back(BasinT(N,i,rng));
     }
+    model_version++;
 
     update_P();
 
     test_logli.assign(niter,0);
     vector<double> logli (niter);
     for (int i=0; i<niter; i++) {
+        if (stop_requested()) {
+            cout << "Stopped before iteration " << i << endl;
+            logli.resize(i);
+            test_logli.resize(i);
+            break;
+        }
         cout << "Iteration " << i << endl;
 
         // E step
 
+        // Basin-major order, so that only one double-precision accumulator is alive at a time
         for (int j=0; j<nbasins; j++) {
             basins[j].reset_stats();
-        }
-        
-        for (state_iter it = train_states.begin(); it!=train_states.end(); ++it) {
-            for (int j=0; j<nbasins; j++) {
+            for (state_iter it = train_states.begin(); it!=train_states.end(); ++it) {
                 basins[j].increment_stats(it->second);
             }
-        }
-        for (int j=0; j<nbasins; j++) {
             basins[j].normalize_stats();
         }
         
@@ -968,6 +1749,7 @@ tuple< vector<double>, vector<double> > EMBasins<BasinT>::train(int niter) {
 
             basins[j].doMLE(alpha);
         }
+        model_version++;
         update_w();
 
         logli[i] = update_P();
@@ -990,10 +1772,11 @@ double EMBasins<BasinT>::update_P() {
     
     double logli = 0;
     double norm = 0;
+    update_emiss(train_states);
     for (state_iter it=train_states.begin(); it != train_states.end(); ++it) {
         State& this_state = it->second;
-        // set_state_P updates this_state.P
-        double Z = set_state_P(this_state);
+        // normalize_state_P turns the emissions in this_state.P into the posterior over basins
+        double Z = normalize_state_P(this_state);
         // Aditya notes: why subtract the running logli here?!
         // this is an online/running mean -- see my explanation in HMM<BasinT>::logli() below
         double delta = log(Z) - logli;
@@ -1014,6 +1797,17 @@ double EMBasins<BasinT>::update_P() {
 template <class BasinT>
 double EMBasins<BasinT>::update_P_test() {
     
+    update_emiss(test_states);
+    for (state_iter it=test_states.begin(); it != test_states.end(); ++it) {
+        // normalize_state_P turns the emissions in this_state.P into the posterior over basins
+        normalize_state_P(it->second);
+    }
+    return test_states_logli();
+}
+
+template <class BasinT>
+double EMBasins<BasinT>::test_states_logli() {
+    // Mean log Z over the test bins, from the normalisers left in State::pred_prob
     double logli = 0;
     double norm = 0;
     // don't use epsilon ~ 10^-16, use min ~ 10^-308
@@ -1021,8 +1815,7 @@ double EMBasins<BasinT>::update_P_test() {
     double logmin = log( std::numeric_limits<double>::min() );
     for (state_iter it=test_states.begin(); it != test_states.end(); ++it) {
         State& this_state = it->second;
-        // set_state_P updates this_state.P
-        double logZ = log( set_state_P(this_state) );
+        double logZ = log( this_state.pred_prob );
         // Aditya notes: added this else nan in logli
         
         if (std::isinf(logZ)) {
@@ -1175,18 +1968,53 @@ vector<paramsStruct> EMBasins<BasinT>::basin_params() {
 
 template <class BasinT>
 vector<char> EMBasins<BasinT>::sample(int nsamples) {
-    vector<char> samples (N*nsamples);
-    for (int i=0; i<nsamples; i++) {
-        int basin_ind = rng->discrete(w);
-        vector<char> this_sample = basins[basin_ind].sample();
+    // Seed drawn from the model's RNG, so that repeated calls give fresh samples
+    return sample(nsamples, rng->get(), default_nthreads());
+}
+
+template <class BasinT>
+vector<char> EMBasins<BasinT>::sample(int nsamples, unsigned long seed, int nthreads) {
+    // Samples are drawn in fixed blocks of sample_block, each from its own RNG
+    // stream (seed, block), so the output depends on the seed but not on the
+    // number of threads.
+    vector<char> samples ((long) N*nsamples);
+    AliasTable w_alias (w.data(), nbasins);
+    int nblocks = (nsamples + sample_block - 1) / sample_block;
+    parallel_for(nblocks, nthreads, [&](int b) {
+        RNG block_rng (seed, b);
+        int s0 = b*sample_block;
+        int s1 = min(s0 + sample_block, nsamples);
+        vector<int> basin_ind (s1-s0);
+        for (int i=0; i<s1-s0; i++) {
+            basin_ind[i] = w_alias.draw(block_rng);
+        }
         // Aditya notes: Careful, the samples "matrix" must be interpreted as (nTimeBins x nNeurons)
         //  samples is represented as a vector here with minor increments (inner loop) for neurons and major (outer loop) for timebins
         //  I've assumed row-major i.e. the C++ default in writePyOutputMatrix
-        for (int n=0; n<N; n++) {
-            samples[i*N+n] = this_sample[n];
+        sample_words(basin_ind.data(), s1-s0, samples.data() + (long) s0*N, block_rng);
+    });
+    return samples;
+}
+
+template <class BasinT>
+void EMBasins<BasinT>::sample_words(const int* basin_ind, int nsamples, char* out, RNG& this_rng) {
+    // Given the basin of every sample, draws the words one basin at a time
+    // with the batch samplers and scatters them into rows of out (nsamples x N)
+    vector<vector<int> > rows (nbasins);
+    for (int i=0; i<nsamples; i++) {
+        rows[basin_ind[i]].push_back(i);
+    }
+    vector<char> batch;
+    for (int k=0; k<nbasins; k++) {
+        int nk = rows[k].size();
+        if (nk == 0) continue;
+        batch.resize((long) nk*N);
+        basins[k].sample(nk, batch.data(), this_rng);
+        for (int j=0; j<nk; j++) {
+            copy(batch.begin() + (long) j*N, batch.begin() + (long) (j+1)*N, out + (long) rows[k][j]*N);
         }
     }
-    return samples;
+    return;
 }
 
 template <class BasinT>
@@ -1208,9 +2036,40 @@ vector<Spike> EMBasins<BasinT>::sort_spikes(const vector<vector<double> >& st, d
 
 template <class BasinT>
 double EMBasins<BasinT>::set_state_P(State& this_state) {
+    for (int i=0; i<nbasins; i++) {
+        this_state.P[i] = basins[i].P_state(this_state);
+    }
+    return normalize_state_P(this_state);
+}
+
+template <class BasinT>
+int EMBasins<BasinT>::cached_state_P(State& this_state) {
+    // set_state_P() through word_cache: a word already scored under the
+    // current model is a hash lookup on its packed bits (State::bits, filled
+    // by the caller). Returns the MAP mode of the word.
+    const WordPosterior* hit = word_cache.find(this_state.bits);
+    if (hit) {
+        this_state.P = hit->P;
+        for (int i=0; i<nbasins; i++) {
+            this_state.weight[i] = this_state.freq * this_state.P[i];
+        }
+        this_state.pred_prob = hit->Z;
+        return hit->mode;
+    }
+    WordPosterior value;
+    value.Z = set_state_P(this_state);
+    value.P = this_state.P;
+    value.mode = max_element(value.P.begin(), value.P.end()) - value.P.begin();
+    word_cache.insert(this_state.bits, value);
+    return value.mode;
+}
+
+template <class BasinT>
+double EMBasins<BasinT>::normalize_state_P(State& this_state) {
+    // On entry this_state.P holds the basin likelihoods P(sigma | basin)
     double Z = 0;
     for (int i=0; i<nbasins; i++) {
-        this_state.P[i] = w[i] * basins[i].P_state(this_state);
+        this_state.P[i] *= w[i];
         Z += this_state.P[i];
     }
     for (int i=0; i<nbasins; i++) {
@@ -1221,6 +2080,34 @@ double EMBasins<BasinT>::set_state_P(State& this_state) {
     return Z;
 }
 
+template <class BasinT>
+void EMBasins<BasinT>::update_emiss(state_map& states) {
+    // Scores every state against every basin in one batched pass, leaving the
+    // basin likelihoods P(sigma | basin) in State::P
+    vector<State*> state_ptrs;
+    state_ptrs.reserve(states.size());
+    for (state_iter it=states.begin(); it!=states.end(); ++it) {
+        state_ptrs.push_back(&(it->second));
+    }
+    vector<double> emiss (state_ptrs.size() * nbasins);
+    P_state_batch(basins, state_ptrs, emiss.data(), default_nthreads());
+    for (int s=0; s<state_ptrs.size(); s++) {
+        for (int i=0; i<nbasins; i++) {
+            state_ptrs[s]->P[i] = emiss[s*nbasins + i];
+        }
+    }
+    return;
+}
+
+template <class BasinT>
+void EMBasins<BasinT>::pack_states(state_map& states) {
+    // Fills State::bits once the histogram is built, for the packed-word kernels
+    for (state_iter it=states.begin(); it!=states.end(); ++it) {
+        pack_word((it->second).word, (it->second).bits);
+    }
+    return;
+}
+
 template <class BasinT>
 vector<char> EMBasins<BasinT>::word_list() {
     vector<char> out (train_states.size() * N);
@@ -1268,26 +2155,66 @@ HMM<BasinT>::HMM(vector<vector<double> >& st, vector<double> unobserved_l, vecto
     
     
     vector<Spike> all_spikes = this->sort_spikes(st, binsize); 
+    build_bins(all_spikes, unobserved_l, unobserved_u);
+}
+
+template <class BasinT>
+HMM<BasinT>::HMM(vector<vector<vector<double> > >& trials, double trial_duration, double binsize, int nbasins) : EMBasins<BasinT> (trials.at(0).size(),nbasins), w0 (nbasins) {
+    // trials[i][n] holds the spike times of neuron n in trial i, measured from
+    // the start of the trial. Every trial is cut to floor(trial_duration/binsize)
+    // bins (later spikes are dropped) and the trials are laid end to end; they
+    // share one state table, and the recursions restart at every trial.
+    cout << "Building state histogram over " << trials.size() << " trials..." << endl;
+    int nbins = floor(trial_duration / binsize);
+    vector<Spike> all_spikes;
+    for (int i=0; i<trials.size(); i++) {
+        vector<Spike> trial_spikes = this->sort_spikes(trials[i], binsize);
+        for (vector<Spike>::iterator it=trial_spikes.begin(); it!=trial_spikes.end(); ++it) {
+            if (it->bin >= 0 && it->bin < nbins) {
+                it->bin += i*nbins;
+                all_spikes.push_back(*it);
+            }
+        }
+        trial_starts.push_back(i*nbins);
+    }
+    // The last spike only closes the bin before it (see build_bins)
+    Spike end_spike;
+    end_spike.bin = trials.size() * nbins;
+    end_spike.neuron_ind = 0;
+    all_spikes.push_back(end_spike);
+    build_bins(all_spikes, vector<double>(), vector<double>());
+    time_threads = default_nthreads();
+    find_segments();
+}
+
+template <class BasinT>
+void HMM<BasinT>::build_bins(const vector<Spike>& all_spikes, const vector<double>& unobserved_l, const vector<double>& unobserved_u) {
+    // Bins [0,T) with T the bin of the last spike; the unobserved bins lie in
+    // [unobserved_l[n], unobserved_u[n]) (in bins)
     T = all_spikes.back().bin;
     
-    forward.assign(T*nbasins, 0);
-    backward.assign(T*nbasins, 0); 
-    trans.assign(nbasins*nbasins, 0);
+    forward.assign(T*this->nbasins, 0);
+    backward.assign(T*this->nbasins, 0); 
+    fb_stale = true;
+    trans.assign(this->nbasins*this->nbasins, 0);
+    unit_emiss.assign(this->nbasins, 1);
 //    words.assign(T, "");
-    vector<string> words (T, "");
+    // Packed word of every bin, nlanes lanes each
+    int nlanes = word_nlanes(this->N);
+    vector<word_lane> words ((long) T*nlanes, 0);
     
-    string silent_str (this->N,'0');
+    word_key silent_key (nlanes, 0);
     // Add silent state with frequency of zero
     State this_state;
-    string this_str = silent_str;
+    word_key this_key = silent_key;
     this_state.freq = 0;
-    this_state.P.assign(nbasins, 0);
-    this_state.weight.assign(nbasins, 0);
+    this_state.P.assign(this->nbasins, 0);
+    this_state.weight.assign(this->nbasins, 0);
     this_state.word.assign(this->N,0);
-    this->all_states.insert(pair<string,State> (silent_str,this_state));
+    state_iter silent = this->all_states.insert(pair<word_key,State> (silent_key,this_state)).first;
 //    test_states.insert(pair<string,State> (silent_str,this_state));
     int curr_bin = 0;
-    for (vector<Spike>::iterator it=all_spikes.begin(); it!=all_spikes.end(); ++it) {
+    for (vector<Spike>::const_iterator it=all_spikes.begin(); it!=all_spikes.end(); ++it) {
         
         int next_bin = it->bin;
         int next_cell = it->neuron_ind;
@@ -1300,22 +2227,20 @@ HMM<BasinT>::HMM(vector<vector<double> >& st, vector<double> unobserved_l, vecto
             }
         }
         if (next_bin > curr_bin) {
-            this->raster.push_back(this_str);
+            this->raster.insert(this->raster.end(), this_key.begin(), this_key.end());
             if (bin_observed) {
                 // Add new state; if it's already been discovered increment its frequency
                 this_state.active_constraints = BasinT::get_active_constraints(this_state);
                 
-                pair<state_iter, bool> ins = this->all_states.insert(pair<string,State> (this_str,this_state));
+                pair<state_iter, bool> ins = this->all_states.insert(pair<word_key,State> (this_key,this_state));
                 if (!ins.second) {
                     (((ins.first)->second).freq)++;
                 }
             
             }
-            // Update probabilities of time bins [curr_bin, next_bin)
-            words[curr_bin] = this_str;
-            for (int n=curr_bin+1; n<next_bin; n++) {
-                words[n] = silent_str;
-            }
+            // Update probabilities of time bins [curr_bin, next_bin); the
+            // bins after curr_bin stay silent (all zero) in words
+            copy(this_key.begin(), this_key.end(), words.begin() + (long) curr_bin*nlanes);
             
             // All states between curr_bin and next_bin (exclusive) are silent; update frequency of silent state accordingly
 //            for (int i=0; i<(next_bin-curr_bin-1); i++) {
@@ -1331,34 +2256,35 @@ HMM<BasinT>::HMM(vector<vector<double> >& st, vector<double> unobserved_l, vecto
                     }
                 }
                 if (t_observed) {
-                    (this->all_states[silent_str].freq)++;
+                    ((silent->second).freq)++;
                 }
-                this->raster.push_back(silent_str);
+                this->raster.insert(this->raster.end(), silent_key.begin(), silent_key.end());
             }
             
             // Reset state and jump to next bin
-            this_str = silent_str;
+            this_key = silent_key;
             this_state.freq = 1;
             this_state.on_neurons.clear();
-            this_state.P.assign(nbasins,0);
-            this_state.weight.assign(nbasins,0);
+            this_state.P.assign(this->nbasins,0);
+            this_state.weight.assign(this->nbasins,0);
             this_state.word.assign(this->N,0);
             
             curr_bin = next_bin;
         }
         // Add next_cell to this_state
         if (this_state.word[next_cell] == 0) {  // Don't want to count a cell twice in one bin
-            this_str[next_cell] = '1';
+            set_word_bit(this_key, next_cell);
             this_state.on_neurons.push_back(next_cell);
             this_state.word[next_cell] = 1;
         }
         
     }
-    if (this->all_states[silent_str].freq == 0) {
-        this->all_states.erase(silent_str);
+    if ((silent->second).freq == 0) {
+        this->all_states.erase(silent);
     }
     
     // Now all_states contains all states found in the data together with their frequencies.
+    this->pack_states(this->all_states);
     int identifier = 0;
     for (state_iter it=this->all_states.begin(); it!=this->all_states.end(); ++it) {
         this->nsamples += (it->second).freq;
@@ -1367,6 +2293,7 @@ HMM<BasinT>::HMM(vector<vector<double> >& st, vector<double> unobserved_l, vecto
     }
     this->train_states = this->all_states;
     state_list.assign(T, NULL);
+    heldout_list.assign(T, NULL);
     for (int t=0; t<T; t++) {
         bool t_observed = true;
         for (int n=0; n<unobserved_l.size(); n++) {
@@ -1375,19 +2302,62 @@ HMM<BasinT>::HMM(vector<vector<double> >& st, vector<double> unobserved_l, vecto
                 break;
             }
         }
+        word_key bin_key (words.begin() + (long) t*nlanes, words.begin() + (long) (t+1)*nlanes);
         if (t_observed) {
-            State& this_state = this->train_states.at(words[t]);
+            State& this_state = this->train_states.at(bin_key);
             state_list[t] = &this_state;
         } else {
             state_list[t] = 0;
+            // Held-out words get their own table, scored alongside train_states
+            pair<state_iter, bool> ins = heldout_states.insert(pair<word_key,State> (bin_key, State()));
+            State& this_state = (ins.first)->second;
+            if (ins.second) {
+                this_state.freq = 0;
+                this_state.P.assign(this->nbasins, 1);
+                this_state.weight.assign(this->nbasins, 0);
+                this_state.word.assign(this->N, 0);
+                for_each_on<0>(bin_key.data(), nlanes, [&](int n) {
+                    this_state.on_neurons.push_back(n);
+                    this_state.word[n] = 1;
+                });
+            }
+            (this_state.freq)++;
+            heldout_list[t] = &this_state;
         }
     }
+    this->pack_states(heldout_states);
+    identifier = 0;
+    for (state_iter it=heldout_states.begin(); it!=heldout_states.end(); ++it) {
+        (it->second).identifier = identifier;
+        identifier++;
+    }
     
     // Cross validation:
     //tskip = 2;
     
     // Full:
     tskip = 1;
+    
+    if (trial_starts.empty()) {
+        trial_starts.push_back(0);
+    }
+    trial_starts.push_back(T);
+    new_trial.assign(T+1, 0);
+    for (vector<int>::iterator it=trial_starts.begin(); it!=trial_starts.end(); ++it) {
+        new_trial[*it] = 1;
+    }
+    
+    min_skip_run = 2;
+    time_threads = 1;
+    checkpoint_interval = 0;
+    sparse_top = 0;
+    sparse_min = 0;
+    beam_rel = 0;
+    beam_width = 0;
+    beam_lost = 0;
+    markov_lambda2 = -1;
+    markov_eps = -1;
+    find_runs();
 
 }
 
@@ -1425,61 +2395,101 @@ vector<double> HMM<BasinT>::emiss_prob() {
 
 template <class BasinT>
 vector<double> HMM<BasinT>::get_forward() {
+    if (!checkpoints.empty()) {
+        return checkpointed_output(0);
+    }
+    refresh_forward_backward();
     return forward;
 }
 
 template <class BasinT>
 vector<double> HMM<BasinT>::get_backward() {
+    if (!checkpoints.empty()) {
+        return checkpointed_output(1);
+    }
+    refresh_forward_backward();
     return backward;
 }
 
+template <class BasinT>
+void HMM<BasinT>::refresh_forward_backward() {
+    // The outputs use the current parameters in both modes: an EM iteration
+    // updates trans and the emissions after its pass, so the stored arrays
+    // are recomputed once before they are read (checkpointed_output() always
+    // sweeps with the current ones)
+    if (fb_stale) {
+        forward_backward();
+    }
+    fill_runs();
+    return;
+}
+
 template <class BasinT>
 tuple <vector<double>, vector<double> > HMM<BasinT>::train(int niter) {
+    init_params();
+    return resume_train(niter);
+}
+
+template <class BasinT>
+void HMM<BasinT>::init_params() {
     
     cout << "Initializing EM params..." << endl;
     
     w0.assign(this->nbasins, 1/(double)this->nbasins);
     trans.assign(this->nbasins*this->nbasins, 1/(double)this->nbasins);
+    trans_row.clear();
     this->basins.clear();
     // Initialize each basin model
     for (int i=0; i<this->nbasins; i++) {
         //        BasinT this_basin  BasinT(N));
         this->basins.push_back(BasinT(this->N,i,this->rng));
     }
+    this->model_version++;
     
     // Initialize emission probabilities
-    for (state_iter it=this->train_states.begin(); it != this->train_states.end(); ++it) {
-        State& this_state = it->second;
-        for (int i=0; i<this->nbasins; i++) {
-            this_state.P[i] = this->basins[i].P_state(this_state);
-        }
+    this->update_emiss(this->train_states);
+    this->update_emiss(heldout_states);
+    em_update(false);
+    return;
+}
+
+template <class BasinT>
+tuple <vector<double>, vector<double> > HMM<BasinT>::resume_train(int niter) {
+    // Each iteration starts from the posteriors of the last E-step, so this
+    // carries on where train() or resume_train() stopped
+    if (this->basins.empty()) {
+        init_params();
     }
-    cout << "forward" << endl;
-    update_forward();
-    cout << "backward" << endl;
-    update_backward();
-    cout << "P" << endl;
-    update_P();
 
+    // Log-likelihoods are reported per bin, over the observed and the held-out bins
+    int nobserved = 0;
+    for (int t=0; t<T; t++) {
+        if (state_list[t]) {
+            nobserved++;
+        }
+    }
+    int nheldout = T - nobserved;
     
 //    test_logli.assign(niter,0);
     vector<double> train_logli (niter);
     vector<double> test_logli (niter);
     for (int i=0; i<niter; i++) {
+        if (this->stop_requested()) {
+            cout << "Stopped before iteration " << i << endl;
+            train_logli.resize(i);
+            test_logli.resize(i);
+            break;
+        }
         cout << "Iteration " << i << endl;
         
         // E step
 
+        // Basin-major order, so that only one double-precision accumulator is alive at a time
         for (int j=0; j<this->nbasins; j++) {
             this->basins[j].reset_stats();
-        }
-        
-        for (state_iter it = this->train_states.begin(); it!=this->train_states.end(); ++it) {
-            for (int j=0; j<this->nbasins; j++) {
+            for (state_iter it = this->train_states.begin(); it!=this->train_states.end(); ++it) {
                 this->basins[j].increment_stats(it->second);
             }
-        }
-        for (int j=0; j<this->nbasins; j++) {
             this->basins[j].normalize_stats();
         }
         
@@ -1495,19 +2505,11 @@ tuple <vector<double>, vector<double> > HMM<BasinT>::train(int niter) {
             
             this->basins[j].doMLE(alpha);
         }
+        this->model_version++;
         
-        cout << "forward" << endl;
-        update_forward();
-        cout << "backward" << endl;
-        update_backward();
-        cout << "P" << endl;
-        update_P();
-        cout << "trans" << endl;
-        update_trans();
-
-        cout << "logli" <<endl;
-        train_logli[i] = logli(true);
-        test_logli[i] = logli(false);
+        pair<double, double> logli = em_update(true);
+        train_logli[i] = (nobserved > 0) ? logli.first / nobserved : 0;
+        test_logli[i] = (nheldout > 0) ? logli.second / nheldout : 0;
         //test_logli[i] = update_P_test();
     }
     return make_tuple(train_logli, test_logli);
@@ -1517,251 +2519,1298 @@ tuple <vector<double>, vector<double> > HMM<BasinT>::train(int niter) {
 
 template <class BasinT>
 void HMM<BasinT>::forward_backward() {
-    
-    // Forward pass
-    vector<double> norm (T,0);
-    for (int n=0; n<this->nbasins; n++) {
-        backward[n] = w0[n];
+    // Both recursions over the full arrays. With the beam on, the prediction
+    // pass (backward) runs first and forward is only computed on its support.
+    update_run_powers();
+    if (beam_active()) {
+        cout << "backward" << endl;
+        update_backward();
+        cout << "forward" << endl;
+        update_forward();
+    } else {
+        cout << "forward" << endl;
+        update_forward();
+        cout << "backward" << endl;
+        update_backward();
     }
-    norm[0] = 1;
-    for (int t=1; t<T; t++) {
-        //        State& this_state = this->train_states.at(words[t-1]);
-//        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            backward[this->nbasins*t + n] = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                if (state_list[t-1]) {
-                    backward[this->nbasins*t + n] += (state_list[t-1]->P)[m] * trans[m*this->nbasins+n] * backward[(t-1)*this->nbasins + m];
-                } else {
-                    backward[this->nbasins*t + n] += trans[m*this->nbasins+n] * backward[(t-1)*this->nbasins + m];
-                    
-                }
-            }
-            norm[t] += backward[this->nbasins*t + n];
-        }
-        for (int n=0; n<this->nbasins; n++) {
-            backward[this->nbasins*t+n] /= norm[t];
-        }
+    fb_stale = false;
+    return;
+}
+
+template <class BasinT>
+pair<double, double> HMM<BasinT>::em_update(bool with_trans) {
+    // Forward-backward pass, then the updates of trans (if with_trans) and of
+    // the basin weights of the states. The statistics come from one fused
+    // pass, over [0,T) or segment by segment in checkpointed mode.
+    // Returns log P(observed bins) and log P(held-out bins | observed bins)
+    // under the parameters the pass was run with, see add_estep_stats() and
+    // joint_logli().
+    int K = this->nbasins;
+    double logli[2] = {0, 0};
+    for (state_iter it=this->train_states.begin(); it != this->train_states.end(); ++it) {
+        it->second.weight.assign(K, 0);
     }
-    
-    // Backward pass
-    
-    for (int n=0; n<this->nbasins; n++) {
-        //        forward[(T-1)*this->nbasins+n] = final_state.P[n];
-        if (state_list[T-1]) {
-            forward[(T-1)*this->nbasins+n] = (state_list[T-1]->P)[n];
-        } else {
-            forward[(T-1)*this->nbasins+n] = 1;
+    // denom[i] is the total posterior of basin i over the observed bins
+    vector<double> denom (K, 0);
+    vector<double> flow (K*K, 0);
+    vector<double>* trans_flow = with_trans ? &flow : NULL;
+    // start_post is the summed posterior at the first bin of each trial, for w0
+    vector<double> start_post (K, 0);
+    auto add_trial_starts = [&](int t0, int t1, const double* fw, const double* bw) {
+        int i = lower_bound(trial_starts.begin(), trial_starts.end(), t0) - trial_starts.begin();
+        for (; trial_starts[i] < t1; i++) {
+            const double* this_fw = fw + (trial_starts[i]-t0)*K;
+            const double* this_bw = bw + (trial_starts[i]-t0)*K;
+            double norm = 0;
+            for (int n=0; n<K; n++) {
+                norm += this_fw[n] * this_bw[n];
+            }
+            for (int n=0; n<K; n++) {
+                start_post[n] += this_fw[n] * this_bw[n] / norm;
+            }
         }
-        norm += forward[(T-1)*this->nbasins+n];
+    };
+    run_group_map groups;
+    if (checkpoints.empty()) {
+        forward_backward();
+        cout << "stats" << endl;
+        add_run_groups(0, T, forward.data(), backward.data(), unit_emiss.data(), groups);
+        add_estep_stats(0, T, forward.data(), backward.data(), NULL, trans_flow, denom, logli);
+        add_trial_starts(0, T, forward.data(), backward.data());
+    } else {
+        cout << "checkpointed forward-backward" << endl;
+        sweep_segments([&](int t0, int t1, double* fw, double* bw, const double* prev_bw, const double* next_fw) {
+            add_trial_starts(t0, t1, fw, bw);
+            add_run_groups(t0, t1, fw, bw, next_fw, groups);
+            add_estep_stats(t0, t1, fw, bw, prev_bw, trans_flow, denom, logli);
+        });
     }
-    
-    for (int n=0; n<this->nbasins; n++) {
-        forward[(T-1)*this->nbasins+n] /= norm;
+    if (!heldout_states.empty()) {
+        logli[1] = joint_logli() - logli[0];
     }
+    finish_run_stats(groups);
+    if (with_trans) {
+        // trans first: finish_P ends by recomputing the emissions, and the
+        // transition posteriors must use the ones forward/backward were run with
+        finish_trans(flow, start_post);
+    }
+    finish_P(denom);
+    fb_stale = true;
+    return make_pair(logli[0], logli[1]);
+}
+
+template <class BasinT>
+void HMM<BasinT>::add_estep_stats(int t0, int t1, double* fw, double* bw, const double* prev_bw, vector<double>* flow, vector<double>& denom, double* logli) {
+    // Fused E-step over the bins of [t0,t1); fw and bw point to bin t0.
+    //  - The posterior of every observed bin outside the skipped runs is added
+    //    to the weights of its state and to denom.
+    //  - For the transition t-1 -> t, with u = e_(t-1) .* backward[t-1] and
+    //    v = forward[t], the expected counts are trans .* (u v^T) / c with
+    //    c = u^T trans v, so flow (when given) collects sum_t u v^T / c.
+    //    estep_block transitions at a time are stacked into panels U and V:
+    //    the c are the row sums of U .* (V trans^T), and flow += (U/c)^T V,
+    //    two matrix products instead of one outer product per bin.
+    // The transition into t0 needs backward at t0-1 in prev_bw (left out when
+    // NULL); those inside skipped runs come from update_run_stats(), and there
+    // is none into the first bin of a trial.
+    //  - logli[0] collects the exact log-likelihood of the observed bins,
+    //    sum_t log(e_t . backward[t]), backward[t] being the prediction of
+    //    bin t from the bins before it. These are the normalisers of the
+    //    backward recursion; a skipped run contributes the normaliser of its
+    //    jump (run_log_step) and the term of its last bin.
+    // (logli[1], over the held-out bins, is left to joint_logli()).
+    int K = this->nbasins;
+    vector<double> U (estep_block*K);
+    vector<double> V (estep_block*K);
+    vector<double> W (estep_block*K);
+    vector<double> this_P (K);
+    bool beam = beam_active();
+    vector<int> u_modes;
+    vector<int> v_modes;
+    int nrows = 0;
+    auto flush = [&]() {
+        if (!trans_row.empty()) {
+            // Sparse trans: c and flow on the kept entries only, O(nnz) per row
+            for (int b=0; b<nrows; b++) {
+                double c = 0;
+                for (int n=0; n<K; n++) {
+                    if (U[b*K+n] == 0) {
+                        continue;
+                    }
+                    double Wn = 0;
+                    for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+                        Wn += trans_val[j] * V[b*K + trans_col[j]];
+                    }
+                    c += U[b*K+n] * Wn;
+                }
+                for (int n=0; n<K; n++) {
+                    double u = U[b*K+n] / c;
+                    if (u == 0) {
+                        continue;
+                    }
+                    for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+                        (*flow)[n*K + trans_col[j]] += u * V[b*K + trans_col[j]];
+                    }
+                }
+            }
+            nrows = 0;
+            return;
+        }
+        bool narrow = beam;
+        if (narrow) {
+            // Beam: u and v are zero off the kept modes, O(B^2) per row;
+            // blocks where the beam is still wide go through the dense kernels
+            long kept = 0;
+            for (int b=0; b<nrows; b++) {
+                int nu = 0;
+                int nv = 0;
+                for (int n=0; n<K; n++) {
+                    nu += (U[b*K+n] > 0);
+                    nv += (V[b*K+n] > 0);
+                }
+                kept += (long) nu * nv;
+            }
+            narrow = (4*kept < (long) nrows*K*K);
+        }
+        if (narrow) {
+            for (int b=0; b<nrows; b++) {
+                u_modes.clear();
+                v_modes.clear();
+                for (int n=0; n<K; n++) {
+                    if (U[b*K+n] > 0) u_modes.push_back(n);
+                    if (V[b*K+n] > 0) v_modes.push_back(n);
+                }
+                double c = 0;
+                for (int i=0; i<u_modes.size(); i++) {
+                    const double* row = &trans[u_modes[i]*K];
+                    double Wn = 0;
+                    for (int j=0; j<v_modes.size(); j++) {
+                        Wn += row[v_modes[j]] * V[b*K + v_modes[j]];
+                    }
+                    c += U[b*K + u_modes[i]] * Wn;
+                }
+                for (int i=0; i<u_modes.size(); i++) {
+                    double u = U[b*K + u_modes[i]] / c;
+                    double* flow_row = &(*flow)[u_modes[i]*K];
+                    for (int j=0; j<v_modes.size(); j++) {
+                        flow_row[v_modes[j]] += u * V[b*K + v_modes[j]];
+                    }
+                }
+            }
+            nrows = 0;
+            return;
+        }
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, nrows, K, K, 1.0, V.data(), K, trans.data(), K, 0.0, W.data(), K);
+        for (int b=0; b<nrows; b++) {
+            double c = 0;
+            for (int n=0; n<K; n++) {
+                c += U[b*K+n] * W[b*K+n];
+            }
+            for (int n=0; n<K; n++) {
+                U[b*K+n] /= c;
+            }
+        }
+        cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, K, K, nrows, 1.0, U.data(), K, V.data(), K, 1.0, flow->data(), K);
+        nrows = 0;
+    };
     
-    
-    for (int t=T-2; t>=0; t--) {
-        //        State& this_state = this->train_states[words[t]];
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            //            forward[t*this->nbasins + n] = this_state.P[n];
+    int r = lower_bound(runs.begin(), runs.end(), t0, run_starts_before) - runs.begin();
+    for (int t=t0; t<t1; t+=tskip) {
+        const double* this_fw = fw + (t-t0)*K;
+        const double* this_bw = bw + (t-t0)*K;
+        if (flow && (t > t0 || prev_bw) && !new_trial[t]) {
+            const double* e = emiss_at(t-tskip);
+            const double* prev = (t > t0) ? this_bw - tskip*K : prev_bw;
+            for (int n=0; n<K; n++) {
+                U[nrows*K+n] = e[n] * prev[n];
+                V[nrows*K+n] = this_fw[n];
+            }
+            nrows++;
+            if (nrows == estep_block) {
+                flush();
+            }
+        }
+        if (r < runs.size() && t == runs[r].start) {
+            // Skipped run: occupancy from run_occupancy in finish_P(), and on
+            // to the transition out of its last bin
+            int last = runs[r].start + runs[r].len - 1;
             if (state_list[t]) {
-                forward[t*this->nbasins + n] = (state_list[t]->P)[n];
+                const double* e = emiss_at(last);
+                const double* last_bw = bw + (last-t0)*K;
+                double pred = 0;
+                for (int i=0; i<K; i++) {
+                    pred += e[i] * last_bw[i];
+                }
+                logli[0] += run_log_step[r] + log(pred);
+            }
+            t = last + 1 - tskip;
+            r++;
+            continue;
+        }
+        if (state_list[t]) {
+            State& this_state = *state_list[t];
+            const double* e = emiss_at(t);
+            double norm = 0;
+            double pred = 0;
+            for (int i=0; i<K; i++) {
+                this_P[i] = this_fw[i] * this_bw[i];
+                norm += this_P[i];
+                pred += e[i] * this_bw[i];
+            }
+            for (int i=0; i<K; i++) {
+                this_P[i] /= norm;
+                this_state.weight[i] += this_P[i];
+                denom[i] += this_P[i];
+            }
+            logli[0] += log(pred);
+        }
+    }
+    if (flow && nrows > 0) {
+        flush();
+    }
+    return;
+}
+template <class BasinT>
+vector<double> HMM<BasinT>::trans_at_t(int t) {
+    return this->trans;
+}
+
+template <class BasinT>
+const double* HMM<BasinT>::emiss_at(int t) const {
+    // Unobserved bins carry no evidence: emission 1 for every basin
+    return state_list[t] ? (state_list[t]->P).data() : unit_emiss.data();
+}
+
+template <class BasinT>
+void HMM<BasinT>::update_forward() {
+    // forward[t] = e_t .* (trans * forward[t+tskip]), normalised, with e_t the
+    // emission vector of bin t; the matrix-vector product goes to BLAS and the
+    // emissions are applied afterwards as an elementwise scaling.
+    // Skipped runs are crossed in one step from their last bin to their first,
+    //    forward[s] ~ M^(L-1) forward[s+L-1],  M = diag(e) trans,
+    // leaving the interior bins to fill_runs(). The run powers come from the
+    // caller (forward_backward()).
+    int K = this->nbasins;
+    int tmax = T + (T%tskip) - tskip;
+    if (time_chunks.size() > 2) {
+        // Parallel in time: the message entering each chunk from the right,
+        // forward[t1] ~ F_(c+1) F_(c+2) ... 1 with F_c = chunk_transfer[c]^T,
+        // comes from a scan over the chunks; then all chunks are filled at once.
+        // Chunks that end where a trial starts need no message.
+        update_chunk_transfer();
+        int nchunks = time_chunks.size() - 1;
+        vector<double> next (K, 1);
+        vector<double> scratch (K);
+        for (int c=nchunks-1; c>=0; c--) {
+            int t1 = time_chunks[c+1];
+            double* last_forward = &forward[(t1-1)*K];
+            const double* e = emiss_at(t1-1);
+            if (new_trial[t1]) {
+                for (int n=0; n<K; n++) {
+                    last_forward[n] = e[n];
+                }
             } else {
-                forward[t*this->nbasins + n] = 1;
+                trans_apply(false, next.data(), last_forward);
+                for (int n=0; n<K; n++) {
+                    last_forward[n] *= e[n];
+                }
             }
-            double tmp = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                tmp += trans[n*this->nbasins + m] * forward[(t+1)*this->nbasins + m];
+            normalize_probs(last_forward, K);
+            if (!chunk_transfer.empty()) {
+                trans_gemv(true, chunk_transfer[c].data(), next.data(), scratch.data(), K);
+                normalize_probs(scratch.data(), K);
+                next.swap(scratch);
             }
-            forward[t*this->nbasins + n] *= tmp;
-            norm += forward[t*this->nbasins + n];
+        }
+        parallel_for(nchunks, time_threads, [&](int c) {
+            forward_range(time_chunks[c], time_chunks[c+1], &forward[time_chunks[c]*K]);
+        });
+    } else {
+        const double* e = emiss_at(tmax);
+        for (int n=0; n<K; n++) {
+            forward[tmax*K + n] = e[n];
+        }
+        normalize_probs(&forward[tmax*K], K);
+        forward_range(0, tmax+1, forward.data());
+    }
+    runs_filled = runs.empty();
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::forward_range(int t0, int t1, double* fw) {
+    // Fills forward at t0 <= t < t1-1 from forward at t1-1, which the caller
+    // sets; fw points to bin t0 (of the full array or of a segment buffer).
+    // The last bin of a trial restarts from e_t alone.
+    // With the beam on (full arrays only), forward[t] is kept to the modes
+    // left in backward[t], whose posterior is zero elsewhere, and each step
+    // only visits the modes kept at t and t+1.
+    int K = this->nbasins;
+    bool beam = beam_active();
+    vector<int> next_modes;
+    auto beam_narrow = [&](int t, const double* next) {
+        // Lists the modes of next; false when the step is cheaper dense
+        const double* kept = &backward[(long) t*K];
+        int nkept = 0;
+        next_modes.clear();
+        for (int m=0; m<K; m++) {
+            nkept += (kept[m] > 0);
+            if (next[m] > 0) {
+                next_modes.push_back(m);
+            }
+        }
+        return !trans_row.empty() || 4L*nkept*next_modes.size() < (long) K*K;
+    };
+    auto beam_mask = [&](int t, double* this_forward) {
+        const double* kept = &backward[(long) t*K];
+        for (int n=0; n<K; n++) {
+            if (kept[n] == 0) {
+                this_forward[n] = 0;
+            }
+        }
+    };
+    int r = lower_bound(runs.begin(), runs.end(), t1, run_starts_before) - runs.begin() - 1;
+    for (int t=t1-1; t>=t0; t-=tskip) {
+        double* this_forward = fw + (t-t0)*K;
+        if (t < t1-1) {
+            const double* e = emiss_at(t);
+            const double* next = this_forward + tskip*K;
+            if (new_trial[t+tskip]) {
+                for (int n=0; n<K; n++) {
+                    this_forward[n] = e[n];
+                }
+            } else if (beam && beam_narrow(t, next)) {
+                const double* kept = &backward[(long) t*K];
+                for (int n=0; n<K; n++) {
+                    double sum = 0;
+                    if (kept[n] > 0 && !trans_row.empty()) {
+                        for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+                            sum += trans_val[j] * next[trans_col[j]];
+                        }
+                    } else if (kept[n] > 0) {
+                        const double* row = &trans[n*K];
+                        for (int i=0; i<next_modes.size(); i++) {
+                            sum += row[next_modes[i]] * next[next_modes[i]];
+                        }
+                    }
+                    this_forward[n] = sum * e[n];
+                }
+            } else {
+                trans_apply(false, next, this_forward);
+                for (int n=0; n<K; n++) {
+                    this_forward[n] *= e[n];
+                }
+            }
+        }
+        if (beam) {
+            beam_mask(t, this_forward);
+        }
+        if (t < t1-1 || beam) {
+            normalize_probs(this_forward, K);
         }
         
-        for (int n=0; n<this->nbasins; n++) {
-            forward[t*this->nbasins + n] /= norm;
+        if (r >= 0 && t == runs[r].start + runs[r].len - 1) {
+            int s = runs[r].start;
+            run_power_apply(state_list[s], runs[r].len - 1, false, this_forward, fw + (s-t0)*K);
+            if (beam) {
+                beam_mask(s, fw + (s-t0)*K);
+            }
+            normalize_probs(fw + (s-t0)*K, K);
+            t = s;
+            r--;
+        }
+    }
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::update_backward() {
+    // backward[t] = trans^T * (e_{t-tskip} .* backward[t-tskip]), normalised
+    // Skipped runs are crossed from their first bin to their last,
+    //    backward[s+L-1] ~ (M^T)^(L-1) backward[s]
+    // In parallel-in-time mode this reuses the chunk transfer matrices of the
+    // preceding update_forward().
+    int K = this->nbasins;
+    for (int n=0; n<K; n++) {
+        backward[n] = w0[n];
+    }
+    beam_lost = 0;
+    if (time_chunks.size() > 2) {
+        // backward at the start of chunk c+1 ~ chunk_transfer[c] * backward at the start of chunk c,
+        // or w0 where a trial starts
+        int nchunks = time_chunks.size() - 1;
+        for (int c=1; c<nchunks; c++) {
+            double* first_backward = &backward[time_chunks[c]*K];
+            if (new_trial[time_chunks[c]]) {
+                copy(w0.begin(), w0.end(), first_backward);
+                continue;
+            }
+            trans_gemv(false, chunk_transfer[c-1].data(), &backward[time_chunks[c-1]*K], first_backward, K);
+            normalize_probs(first_backward, K);
+        }
+        parallel_for(nchunks, time_threads, [&](int c) {
+            backward_range(time_chunks[c], time_chunks[c+1], &backward[time_chunks[c]*K]);
+        });
+    } else {
+        backward_range(0, T, backward.data());
+    }
+    runs_filled = runs.empty();
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::backward_range(int t0, int t1, double* bw) {
+    // Fills backward at t0 < t < t1 from backward at t0, which the caller sets;
+    // bw points to bin t0. The first bin of a trial restarts from w0.
+    // With the beam on, every bin is pruned (beam_prune()) and the next step
+    // only spreads the kept modes, O(B K).
+    int K = this->nbasins;
+    bool beam = beam_active();
+    vector<double> scaled (K);
+    vector<double> scratch;
+    int r = lower_bound(runs.begin(), runs.end(), t0, run_starts_before) - runs.begin();
+    for (int t=t0; t<t1; t+=tskip) {
+        double* this_backward = bw + (t-t0)*K;
+        if (t > t0 && new_trial[t]) {
+            copy(w0.begin(), w0.end(), this_backward);
+        } else if (t > t0) {
+            const double* e = emiss_at(t-tskip);
+            const double* prev = this_backward - tskip*K;
+            for (int m=0; m<K; m++) {
+                scaled[m] = e[m] * prev[m];
+            }
+            trans_apply(true, scaled.data(), this_backward, beam);
+            normalize_probs(this_backward, K);
+        }
+        if (beam) {
+            beam_lost += beam_prune(this_backward, scratch);
         }
         
+        if (r < runs.size() && t == runs[r].start) {
+            int last = t + runs[r].len - 1;
+            run_power_apply(state_list[t], runs[r].len - 1, true, this_backward, bw + (last-t0)*K);
+            double norm = normalize_probs(bw + (last-t0)*K, K);
+            run_log_step[r] = log(norm) + (runs[r].len - 1) * run_log_rho.find(state_list[t])->second;
+            if (beam) {
+                beam_lost += beam_prune(bw + (last-t0)*K, scratch);
+            }
+            t = last;
+            r++;
+        }
     }
+    return;
+}
 
+template <class BasinT>
+void HMM<BasinT>::set_time_threads(int nthreads) {
+    time_threads = nthreads;
+    find_segments();
+    return;
+}
 
+template <class BasinT>
+void HMM<BasinT>::set_checkpoints(int interval) {
+    // Discards the stored recursions: switching to checkpoints frees forward
+    // and backward, switching back reallocates them
+    checkpoint_interval = interval;
+    find_segments();
     return;
 }
 
 template <class BasinT>
-vector<double> HMM<BasinT>::trans_at_t(int t) {
-    return this->trans;
+vector<int> HMM<BasinT>::segment_bounds(int nseg, bool at_trials) {
+    // Boundaries of nseg roughly equal segments of [0,T), each moved back to
+    // the start of any skipped run it would cut, or with at_trials on to the
+    // next trial start (runs never cross those)
+    vector<int> bounds (1, 0);
+    int r = 0;
+    for (int c=1; c<nseg; c++) {
+        int t = (int) (((long) T * c) / nseg);
+        if (at_trials) {
+            t = *lower_bound(trial_starts.begin(), trial_starts.end(), t);
+            if (t > bounds.back() && t < T) {
+                bounds.push_back(t);
+            }
+            continue;
+        }
+        while (r < runs.size() && runs[r].start + runs[r].len <= t) {
+            r++;
+        }
+        if (r < runs.size() && runs[r].start < t) {
+            t = runs[r].start;
+        }
+        if (t > bounds.back()) {
+            bounds.push_back(t);
+        }
+    }
+    bounds.push_back(T);
+    return bounds;
 }
 
 template <class BasinT>
-void HMM<BasinT>::update_forward() {
-//    State& final_state = this->train_states.at(words[T-1]);
+void HMM<BasinT>::find_segments() {
+    // Time chunks (one per thread) or checkpoint segments; checkpointing is
+    // sequential and takes precedence. With several trials the chunks are
+    // whole trials, which need no transfer matrices.
+    time_chunks.clear();
+    chunk_transfer.clear();
+    checkpoints.clear();
+    if (tskip == 1 && checkpoint_interval != 0) {
+        int interval = (checkpoint_interval > 0) ? checkpoint_interval : (int) ceil(sqrt((double) T));
+        checkpoints = segment_bounds((T + interval - 1) / interval);
+    } else if (tskip == 1 && time_threads > 1) {
+        time_chunks = segment_bounds(time_threads, ntrials() > 1);
+    }
+    long full_size = checkpoints.empty() ? (long) T*this->nbasins : 0;
+    if (forward.size() != full_size) {
+        vector<double> (full_size, 0).swap(forward);
+        vector<double> (full_size, 0).swap(backward);
+        fb_stale = true;
+    }
+    return;
+}
 
+template <class BasinT>
+template <class F>
+void HMM<BasinT>::sweep_segments(F visit) {
+    // Checkpointed forward-backward. The first pass runs the forward recursion
+    // over the segments from the last one back, keeping forward only at the
+    // first bin of each. The second pass walks the segments from the first,
+    // recomputes forward over each from the checkpoint after it and continues
+    // the backward recursion through it, then calls
+    //    visit(t0, t1, fw, bw, prev_bw, next_fw)
+    // with forward/backward over [t0,t1) in fw/bw, backward at t0-1 in prev_bw
+    // (NULL for the first segment) and forward at t1 in next_fw (ones past the
+    // end). Memory is O(K (nseg + longest segment)) instead of O(K T), for one
+    // extra forward recursion; the results are the same as with full arrays.
+    int K = this->nbasins;
+    int nseg = checkpoints.size() - 1;
+    int max_len = 0;
+    for (int c=0; c<nseg; c++) {
+        max_len = max(max_len, checkpoints[c+1] - checkpoints[c]);
+    }
+    vector<double> saved ((nseg+1)*K, 1);
+    vector<double> fw (max_len*K);
+    vector<double> bw (max_len*K);
+    vector<double> prev_bw (K);
+    vector<double> scaled (K);
+    update_run_powers();
     
-    double norm = 0;
-    int tmax = T + (T%tskip) - tskip;
-    for (int n=0; n<this->nbasins; n++) {
-//        forward[(T-1)*this->nbasins+n] = final_state.P[n];
-        if (state_list[tmax]) {
-            forward[tmax*this->nbasins+n] = (state_list[tmax]->P)[n];
+    auto forward_segment = [&](int c) {
+        int t0 = checkpoints[c];
+        int t1 = checkpoints[c+1];
+        double* last_forward = &fw[(t1-1-t0)*K];
+        const double* e = emiss_at(t1-1);
+        if (new_trial[t1]) {
+            for (int n=0; n<K; n++) {
+                last_forward[n] = e[n];
+            }
         } else {
-            forward[tmax*this->nbasins+n] = 1;
+            trans_apply(false, &saved[(c+1)*K], last_forward);
+            for (int n=0; n<K; n++) {
+                last_forward[n] *= e[n];
+            }
         }
-        norm += forward[tmax*this->nbasins+n];
-    }
+        normalize_probs(last_forward, K);
+        forward_range(t0, t1, fw.data());
+    };
     
-    for (int n=0; n<this->nbasins; n++) {
-        forward[tmax*this->nbasins+n] /= norm;
+    for (int c=nseg-1; c>=0; c--) {
+        forward_segment(c);
+        for (int n=0; n<K; n++) {
+            saved[c*K + n] = fw[n];
+        }
     }
-    
-    vector<double> this_trans (this->nbasins*this->nbasins);
-    
-    for (int t=tmax-tskip; t>=0; t-=tskip) {
-//        State& this_state = this->train_states[words[t]];
-        double norm = 0;
-        this_trans = trans_at_t(t);
-        
-        for (int n=0; n<this->nbasins; n++) {
-//            forward[t*this->nbasins + n] = this_state.P[n];
-            if (state_list[t]) {
-                forward[t*this->nbasins + n] = (state_list[t]->P)[n];
-            } else {
-                forward[t*this->nbasins + n] = 1;
-            }
-            double tmp = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                tmp += this_trans[n*this->nbasins + m] * forward[(t+tskip)*this->nbasins + m];
+    for (int c=0; c<nseg; c++) {
+        int t0 = checkpoints[c];
+        int t1 = checkpoints[c+1];
+        if (c > 0) {
+            // (fw still holds segment 0 from the first pass)
+            forward_segment(c);
+        }
+        if (new_trial[t0]) {
+            copy(w0.begin(), w0.end(), bw.begin());
+        } else {
+            const double* e = emiss_at(t0-1);
+            for (int m=0; m<K; m++) {
+                scaled[m] = e[m] * prev_bw[m];
             }
-            forward[t*this->nbasins + n] *= tmp;            
-            norm += forward[t*this->nbasins + n];
+            trans_apply(true, scaled.data(), bw.data());
+            normalize_probs(bw.data(), K);
         }
-        
-        for (int n=0; n<this->nbasins; n++) {
-            forward[t*this->nbasins + n] /= norm;
+        backward_range(t0, t1, bw.data());
+        visit(t0, t1, fw.data(), bw.data(), (c > 0) ? prev_bw.data() : NULL, &saved[(c+1)*K]);
+        for (int n=0; n<K; n++) {
+            prev_bw[n] = bw[(t1-1-t0)*K + n];
         }
-         
     }
     return;
 }
 
+template <class BasinT>
+vector<double> HMM<BasinT>::checkpointed_output(int which) {
+    // forward (which = 0), backward (1) or the posterior P (2) at every bin,
+    // from a fresh checkpointed sweep with the current parameters, as
+    // refresh_forward_backward() gives with full arrays
+    int K = this->nbasins;
+    vector<double> out ((long) T*K);
+    sweep_segments([&](int t0, int t1, double* fw, double* bw, const double* prev_bw, const double* next_fw) {
+        int r = lower_bound(runs.begin(), runs.end(), t0, run_starts_before) - runs.begin();
+        for (; r < runs.size() && runs[r].start < t1; r++) {
+            fill_run(runs[r], fw + (runs[r].start-t0)*K, bw + (runs[r].start-t0)*K);
+        }
+        for (int t=t0; t<t1; t++) {
+            double* this_out = &out[(long) t*K];
+            const double* this_fw = fw + (t-t0)*K;
+            const double* this_bw = bw + (t-t0)*K;
+            for (int n=0; n<K; n++) {
+                this_out[n] = (which == 0) ? this_fw[n] : (which == 1) ? this_bw[n] : this_fw[n]*this_bw[n];
+            }
+            if (which == 2) {
+                normalize_probs(this_out, K);
+            }
+        }
+    });
+    return out;
+}
 
 template <class BasinT>
-void HMM<BasinT>::update_backward() {    
-    for (int n=0; n<this->nbasins; n++) {
-        backward[n] = w0[n];
+void HMM<BasinT>::update_chunk_transfer() {
+    // Transfer matrix of chunk [t0,t1), built in parallel over the chunks:
+    //    H_c = (trans^T D_(t1-1)) ... (trans^T D_t0),   D_t = diag(e_t),
+    // so that backward[t1] ~ H_c backward[t0] and forward[t0] ~ H_c^T forward[t1].
+    // Skipped runs enter through the binary powers of M, (M^T)^L. H_c is
+    // rescaled to unit maximum after every step; only its direction matters.
+    // Each bin costs a K x K matrix product instead of a matrix-vector product,
+    // so this only pays off with many threads compared with K. Nothing is
+    // built when every chunk starts a trial. The step into the first bin of a
+    // trial is w0 1^T instead of trans^T.
+    int K = this->nbasins;
+    int nchunks = time_chunks.size() - 1;
+    chunk_transfer.clear();
+    bool at_trials = true;
+    for (int c=1; c<nchunks; c++) {
+        at_trials = at_trials && new_trial[time_chunks[c]];
     }
-    vector<double> this_trans (this->nbasins*this->nbasins);
-    for (int t=tskip; t<T; t+=tskip) {
-//        State& this_state = this->train_states.at(words[t-1]);
-        this_trans = trans_at_t(t);
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            backward[this->nbasins*t + n] = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                if (state_list[t-tskip]) {
-                    backward[this->nbasins*t + n] += (state_list[t-tskip]->P)[m] * this_trans[m*this->nbasins+n] * backward[(t-tskip)*this->nbasins + m];
+    if (at_trials) {
+        return;
+    }
+    chunk_transfer.assign(nchunks, vector<double> (K*K));
+    parallel_for(nchunks, time_threads, [&](int c) {
+        vector<double>& H = chunk_transfer[c];
+        vector<double> scaled (K*K);
+        for (int i=0; i<K; i++) {
+            H[i*K+i] = 1;
+        }
+        int r = lower_bound(runs.begin(), runs.end(), time_chunks[c], run_starts_before) - runs.begin();
+        for (int t=time_chunks[c]; t<time_chunks[c+1]; t++) {
+            if (r < runs.size() && t == runs[r].start) {
+                const vector<vector<double> >& powers = run_powers.find(state_list[t])->second;
+                int len = runs[r].len;
+                for (int j=0; (len >> j) > 0; j++) {
+                    if ((len >> j) & 1) {
+                        cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, K, K, K, 1.0, powers[j].data(), K, H.data(), K, 0.0, scaled.data(), K);
+                        H.swap(scaled);
+                    }
+                }
+                t += len - 1;
+                r++;
+            } else {
+                const double* e = emiss_at(t);
+                for (int i=0; i<K; i++) {
+                    for (int j=0; j<K; j++) {
+                        scaled[i*K+j] = e[i] * H[i*K+j];
+                    }
+                }
+                if (new_trial[t+1]) {
+                    for (int j=0; j<K; j++) {
+                        double col = 0;
+                        for (int i=0; i<K; i++) {
+                            col += scaled[i*K+j];
+                        }
+                        for (int i=0; i<K; i++) {
+                            H[i*K+j] = w0[i] * col;
+                        }
+                    }
+                } else if (!trans_row.empty()) {
+                    // H = trans^T scaled from the kept entries, O(nnz K)
+                    H.assign(K*K, 0);
+                    for (int n=0; n<K; n++) {
+                        for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+                            double a = trans_val[j];
+                            double* H_row = &H[trans_col[j]*K];
+                            for (int k=0; k<K; k++) {
+                                H_row[k] += a * scaled[n*K+k];
+                            }
+                        }
+                    }
                 } else {
-                    backward[this->nbasins*t + n] += this_trans[m*this->nbasins+n] * backward[(t-tskip)*this->nbasins + m];
+                    cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, K, K, K, 1.0, trans.data(), K, scaled.data(), K, 0.0, H.data(), K);
+                }
+            }
+            double max_entry = *max_element(H.begin(), H.end());
+            if (max_entry > 0) {
+                for (int i=0; i<K*K; i++) {
+                    H[i] /= max_entry;
                 }
             }
-            norm += backward[this->nbasins*t + n];
         }
-        for (int n=0; n<this->nbasins; n++) {
-            backward[this->nbasins*t+n] /= norm;
+    });
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::set_min_skip_run(int n) {
+    min_skip_run = n;
+    find_runs();
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::find_runs() {
+    // Collects the maximal runs of identical observations (same State, or
+    // unobserved) of at least min_skip_run bins. Runs are grouped by
+    // (state, length) L, and a group is skipped only when that is cheaper: bin
+    // by bin costs ~4*count*L*K*s over the four passes (s entries per row of
+    // trans, K when dense), the closed form ~4*K^3*log2(L) for the group's run
+    // sums plus ~count*K^2*(3*log2(L)+2) for the per-run jumps.
+    runs.clear();
+    runs_filled = true;
+    if (min_skip_run < 2 || tskip != 1) {
+        find_segments();
+        return;
+    }
+    int K = this->nbasins;
+    vector<ObsRun> candidates;
+    map<pair<State*, int>, int> count;
+    int t = 0;
+    while (t < T) {
+        ObsRun run;
+        run.start = t;
+        while (t < T && state_list[t] == state_list[run.start] && (t == run.start || !new_trial[t])) {
+            t++;
+        }
+        run.len = t - run.start;
+        if (run.len >= min_skip_run) {
+            candidates.push_back(run);
+            count[make_pair(state_list[run.start], run.len)]++;
+        }
+    }
+    double row_fill = (sparse_top > 0 && sparse_top < K) ? (double) sparse_top / K : 1;
+    for (vector<ObsRun>::iterator it=candidates.begin(); it!=candidates.end(); ++it) {
+        double n = count[make_pair(state_list[it->start], it->len)];
+        double log_len = log2((double) it->len);
+        if (4*n*it->len*row_fill > 4*K*log_len + n*(3*log_len + 2)) {
+            runs.push_back(*it);
+        }
+    }
+    find_segments();
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::update_run_powers() {
+    // For each state with skipped runs, M = diag(e) trans rescaled by its Perron
+    // root rho so that its powers neither underflow nor overflow over long runs
+    // (the run statistics below are ratios of equal powers of M, so rho cancels).
+    // log rho is estimated from repeated squaring, log|M^(2^J)| / 2^J.
+    run_powers.clear();
+    run_log_rho.clear();
+    run_log_step.assign(runs.size(), 0);
+    if (runs.empty()) {
+        return;
+    }
+    int K = this->nbasins;
+    map<State*, int> max_len;
+    for (vector<ObsRun>::iterator it=runs.begin(); it!=runs.end(); ++it) {
+        int& len = max_len[state_list[it->start]];
+        len = (it->len > len) ? it->len : len;
+    }
+    for (map<State*, int>::iterator it=max_len.begin(); it!=max_len.end(); ++it) {
+        int J = 0;
+        while ((1 << J) < it->second) {
+            J++;
+        }
+        vector<vector<double> > powers (J+1, vector<double> (K*K));
+        vector<double> log_scale (J+1, 0);
+        const double* e = it->first ? (it->first->P).data() : unit_emiss.data();
+        for (int i=0; i<K; i++) {
+            for (int j=0; j<K; j++) {
+                powers[0][i*K+j] = e[i] * trans[i*K+j];
+            }
+        }
+        for (int j=0; j<=J; j++) {
+            if (j > 0) {
+                mat_mul(powers[j-1].data(), powers[j-1].data(), powers[j].data(), K);
+                log_scale[j] = 2*log_scale[j-1];
+            }
+            double max_entry = *max_element(powers[j].begin(), powers[j].end());
+            if (max_entry > 0) {
+                for (int i=0; i<K*K; i++) {
+                    powers[j][i] /= max_entry;
+                }
+                log_scale[j] += log(max_entry);
+            }
+        }
+        double log_rho = log_scale[J] / (1 << J);
+        for (int j=0; j<=J; j++) {
+            double factor = exp(log_scale[j] - (1 << j)*log_rho);
+            for (int i=0; i<K*K; i++) {
+                powers[j][i] *= factor;
+            }
+        }
+        run_powers[it->first].swap(powers);
+        run_log_rho[it->first] = log_rho;
+    }
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::run_power_apply(State* this_state, int n, bool transpose, const double* x, double* y) {
+    // y = (M/rho)^n x, or its transpose, from the binary powers of M/rho
+    int K = this->nbasins;
+    const vector<vector<double> >& powers = run_powers.find(this_state)->second;
+    vector<double> curr (x, x+K);
+    vector<double> next (K);
+    for (int j=0; (n >> j) > 0; j++) {
+        if ((n >> j) & 1) {
+            trans_gemv(transpose, powers[j].data(), curr.data(), next.data(), K);
+            curr.swap(next);
+        }
+    }
+    for (int i=0; i<K; i++) {
+        y[i] = curr[i];
+    }
+    return;
+}
+
+template <class BasinT>
+vector<double> HMM<BasinT>::run_sum(State* this_state, int n, const vector<double>& Y, vector<double>& power) {
+    // Returns S_n(Y) = sum_{k<n} M^(n-1-k) Y M^k with M = M/rho, and sets power = M^n.
+    // Built from the most significant bit of n down with
+    //    S_2m = M^m S_m + S_m M^m,    S_(m+1) = M S_m + Y M^m
+    int K = this->nbasins;
+    const vector<double>& M = run_powers[this_state][0];
+    vector<double> S (K*K, 0);
+    vector<double> tmp (K*K);
+    power.assign(K*K, 0);
+    for (int i=0; i<K; i++) {
+        power[i*K+i] = 1;
+    }
+    int top = 0;
+    while ((n >> (top+1)) > 0) {
+        top++;
+    }
+    for (int j=top; j>=0; j--) {
+        if (j < top) {
+            mat_mul(power.data(), S.data(), tmp.data(), K);
+            mat_mul(S.data(), power.data(), tmp.data(), K, 1.0);
+            S.swap(tmp);
+            mat_mul(power.data(), power.data(), tmp.data(), K);
+            power.swap(tmp);
+        }
+        if ((n >> j) & 1) {
+            mat_mul(M.data(), S.data(), tmp.data(), K);
+            mat_mul(Y.data(), power.data(), tmp.data(), K, 1.0);
+            S.swap(tmp);
+            mat_mul(power.data(), M.data(), tmp.data(), K);
+            power.swap(tmp);
+        }
+    }
+    return S;
+}
+
+template <class BasinT>
+void HMM<BasinT>::update_run_stats() {
+    // Posterior sums over the skipped runs, without visiting their bins. In a
+    // run s..s+L-1 with a = backward[s], b = forward[s+L] (all ones past the
+    // end of its trial) and X = b a^T, the posterior normaliser c = a^T M^L b is the same in
+    // every bin and
+    //    sum_k gamma_(s+k)      = diag(M S_L(X)) / c
+    //    sum_k xi_(s+k,s+k+1)   = M .* (M S_(L-1)(X))^T / c
+    // S is linear in X, so the X/c of all runs with the same state and length
+    // are added up first and S is evaluated once per group.
+    run_group_map groups;
+    add_run_groups(0, T, forward.data(), backward.data(), unit_emiss.data(), groups);
+    finish_run_stats(groups);
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::add_run_groups(int t0, int t1, const double* fw, const double* bw, const double* next_fw, run_group_map& groups) {
+    // Adds the X/c of the runs starting in [t0,t1) to their groups; fw and bw
+    // point to bin t0, next_fw is forward at t1
+    int K = this->nbasins;
+    vector<double> Mb (K);
+    int r = lower_bound(runs.begin(), runs.end(), t0, run_starts_before) - runs.begin();
+    for (; r < runs.size() && runs[r].start < t1; r++) {
+        int s = runs[r].start;
+        int L = runs[r].len;
+        const double* a = bw + (s-t0)*K;
+        const double* b = new_trial[s+L] ? unit_emiss.data() : (s+L < t1) ? fw + (s+L-t0)*K : next_fw;
+        run_power_apply(state_list[s], L, false, b, Mb.data());
+        double c = 0;
+        for (int i=0; i<K; i++) {
+            c += a[i] * Mb[i];
+        }
+        vector<double>& Y = groups[make_pair(state_list[s], L)];
+        Y.resize(K*K, 0);
+        for (int i=0; i<K; i++) {
+            for (int j=0; j<K; j++) {
+                Y[i*K+j] += b[i] * a[j] / c;
+            }
+        }
+    }
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::finish_run_stats(run_group_map& groups) {
+    // run_trans and run_occupancy from the summed X/c of each group
+    int K = this->nbasins;
+    run_trans.assign(K*K, 0);
+    run_occupancy.clear();
+    vector<double> MS (K*K);
+    for (run_group_map::iterator it=groups.begin(); it!=groups.end(); ++it) {
+        State* this_state = it->first.first;
+        int L = it->first.second;
+        const vector<double>& Y = it->second;
+        const vector<double>& M = run_powers[this_state][0];
+        vector<double> power;
+        vector<double> S = run_sum(this_state, L-1, Y, power);
+        mat_mul(M.data(), S.data(), MS.data(), K);
+        for (int i=0; i<K; i++) {
+            for (int j=0; j<K; j++) {
+                run_trans[i*K+j] += M[i*K+j] * MS[j*K+i];
+            }
+        }
+        if (this_state) {
+            // S_L = M S_(L-1) + Y M^(L-1)
+            mat_mul(Y.data(), power.data(), MS.data(), K, 1.0);
+            vector<double>& occupancy = run_occupancy[this_state];
+            occupancy.resize(K, 0);
+            for (int m=0; m<K; m++) {
+                for (int j=0; j<K; j++) {
+                    occupancy[m] += M[m*K+j] * MS[j*K+m];
+                }
+            }
         }
+    }
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::fill_runs() {
+    // Steps through the interior of the skipped runs bin by bin, for the
+    // outputs that return forward/backward/P at every bin. Uses the M of the
+    // last recursions (trans and the emissions have been updated since).
+    if (runs_filled) {
+        return;
+    }
+    int K = this->nbasins;
+    parallel_for(runs.size(), time_threads, [&](int r) {
+        fill_run(runs[r], &forward[runs[r].start*K], &backward[runs[r].start*K]);
+    });
+    runs_filled = true;
+    return;
+}
 
+template <class BasinT>
+void HMM<BasinT>::fill_run(const ObsRun& run, double* fw, double* bw) {
+    // fw and bw point to the run's first bin
+    int K = this->nbasins;
+    int last = run.len - 1;
+    const vector<double>& M = run_powers.find(state_list[run.start])->second[0];
+    for (int k=1; k<last; k++) {
+        trans_gemv(true, M.data(), bw + (k-1)*K, bw + k*K, K);
+        normalize_probs(bw + k*K, K);
+    }
+    for (int k=last-1; k>0; k--) {
+        trans_gemv(false, M.data(), fw + (k+1)*K, fw + k*K, K);
+        normalize_probs(fw + k*K, K);
     }
     return;
 }
 
 template <class BasinT>
-void HMM<BasinT>::update_trans() {
-    // Update w0
+void HMM<BasinT>::finish_trans(vector<double>& flow, const vector<double>& start_post) {
+    // Update w0: mean posterior at the first bin of the trials
     double norm=0;
     for (int n=0; n<this->nbasins; n++) {
-        w0[n] *= forward[n];
-        norm += w0[n];
+        norm += start_post[n];
     }
 
     for (int n=0; n<this->nbasins; n++) {
-        w0[n] /= norm;
+        w0[n] = start_post[n] / norm;
     }
     
     // Update trans
-    vector<double> num (this->nbasins*this->nbasins,0);
-    vector<double> prob (this->nbasins*this->nbasins);
-    for (int t=tskip; t<T; t+=tskip) {
-//        State& this_state = this->train_states.at(words[t-1]);
+    // Expected transition counts trans .* flow, see add_estep_stats(), plus
+    // those inside the skipped runs (num is their sum; the row normalisation
+    // below makes that equivalent to the mean)
+    vector<double> num (this->nbasins*this->nbasins);
+    for (int n=0; n<this->nbasins*this->nbasins; n++) {
+        num[n] = trans[n] * flow[n];
+    }
+    for (int n=0; n<this->nbasins*this->nbasins && !runs.empty(); n++) {
+        num[n] += run_trans[n];
+    }
+    for (int n=0; n<this->nbasins; n++) {
+        double norm = 0;
+        for (int m=0; m<this->nbasins; m++) {
+            norm += num[n*this->nbasins+m];
+        }
+        for (int m=0; m<this->nbasins; m++) {
+            trans[n*this->nbasins+m] = num[n*this->nbasins+m]/norm;
+        }
+    }
+    if (sparse_top > 0 || sparse_min > 0) {
+        prune_trans();
+    }
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::set_sparse_trans(int top, double min_prob) {
+    // Takes effect at the next update of trans in train(); the first iteration
+    // starts from the dense uniform trans. Sparse rows make bin-by-bin steps
+    // cheaper, so the skipped runs are chosen again.
+    sparse_top = top;
+    sparse_min = min_prob;
+    trans_row.clear();
+    find_runs();
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::set_beam(double rel_threshold, int max_modes) {
+    beam_rel = rel_threshold;
+    beam_width = max_modes;
+    beam_lost = 0;
+    return;
+}
+
+template <class BasinT>
+bool HMM<BasinT>::beam_active() const {
+    // The beam prunes forward-backward only with full arrays and sequential
+    // recursions (forward has to see the pruned backward at every bin);
+    // viterbi() uses it whatever the mode
+    return (beam_rel > 0 || beam_width > 0) && checkpoints.empty() && time_chunks.empty();
+}
 
+template <class BasinT>
+double HMM<BasinT>::beam_prune(double* p, vector<double>& scratch) {
+    // Zeroes the modes of the normalised p with less than beam_rel times the
+    // largest mass, or outside the beam_width largest, renormalises and
+    // returns the mass dropped. The recursions then only carry the kept modes.
+    int K = this->nbasins;
+    double largest = *max_element(p, p+K);
+    double cutoff = beam_cutoff(p, K, beam_width, beam_rel*largest, scratch);
+    double lost = 0;
+    for (int n=0; n<K; n++) {
+        if (p[n] < cutoff) {
+            lost += p[n];
+            p[n] = 0;
+        }
+    }
+    if (lost > 0) {
+        for (int n=0; n<K; n++) {
+            p[n] /= (1 - lost);
+        }
+    }
+    return lost;
+}
+
+template <class BasinT>
+void HMM<BasinT>::prune_trans() {
+    // Keeps the sparse_top largest entries of each row of trans (all if
+    // sparse_top <= 0) that are at least sparse_min, the row maximum always
+    // among them, sets the others to zero and renormalises the row. The kept
+    // entries are also stored by row in CSR form, which the recursions use:
+    // O(K s) per bin instead of O(K^2) for s entries per row. EM never revives
+    // a zero transition, so the pattern only shrinks over the iterations.
+    int K = this->nbasins;
+    int top = (sparse_top > 0 && sparse_top < K) ? sparse_top : K;
+    trans_row.assign(1, 0);
+    trans_col.clear();
+    trans_val.clear();
+    vector<int> order (K);
+    for (int n=0; n<K; n++) {
+        double* row = &trans[n*K];
+        for (int m=0; m<K; m++) {
+            order[m] = m;
+        }
+        nth_element(order.begin(), order.begin() + (top-1), order.end(), [&](int a, int b) {
+            return (row[a] > row[b]) || (row[a] == row[b] && a < b);
+        });
+        double cutoff = row[order[top-1]];
+        int largest = max_element(row, row+K) - row;
+        int ties = top;             // Entries equal to the cutoff that still fit
+        for (int m=0; m<K; m++) {
+            if (row[m] > cutoff) {
+                ties--;
+            }
+        }
         double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            double tmp;
-            if (state_list[t-tskip]) {
-                tmp = (state_list[t-tskip]->P)[n] * backward[(t-tskip)*this->nbasins+n];
+        for (int m=0; m<K; m++) {
+            bool keep = (row[m] > cutoff) || (row[m] == cutoff && ties-- > 0);
+            if (keep && row[m] > 0 && (row[m] >= sparse_min || m == largest)) {
+                norm += row[m];
             } else {
-                tmp = backward[(t-tskip)*this->nbasins+n];
+                row[m] = 0;
             }
-            for (int m=0; m<this->nbasins; m++) {
-                prob[n*this->nbasins+m] = tmp * trans[n*this->nbasins + m] * forward[t*this->nbasins + m];
-                norm += prob[n*this->nbasins + m];
+        }
+        for (int m=0; m<K; m++) {
+            if (row[m] > 0) {
+                row[m] /= norm;
+                trans_col.push_back(m);
+                trans_val.push_back(row[m]);
             }
         }
-        for (int n=0; n<this->nbasins*this->nbasins; n++) {
-            prob[n] /= norm;
+        trans_row.push_back(trans_col.size());
+    }
+    return;
+}
+
+template <class BasinT>
+void HMM<BasinT>::trans_apply(bool transpose, const double* x, double* y, bool sparse_x) const {
+    // y = trans x, or trans^T x if transpose; from the CSR form when trans is
+    // sparse. sparse_x: x is mostly zeros (beam), so trans^T x only adds up
+    // the rows of trans at its nonzero entries.
+    int K = this->nbasins;
+    if (trans_row.empty() && transpose && sparse_x) {
+        int nnz = 0;
+        for (int n=0; n<K; n++) {
+            nnz += (x[n] != 0);
         }
-        for (int n=0; n<this->nbasins; n++) {
-            for (int m=0; m<this->nbasins; m++) {
-                double delta_num = prob[n*this->nbasins+m] - num[n*this->nbasins+m];
-                num[n*this->nbasins+m] += delta_num / t;
+        sparse_x = (4*nnz < K);
+    }
+    if (trans_row.empty() && !(transpose && sparse_x)) {
+        trans_gemv(transpose, trans.data(), x, y, K);
+        return;
+    }
+    if (trans_row.empty()) {
+        for (int m=0; m<K; m++) {
+            y[m] = 0;
+        }
+        for (int n=0; n<K; n++) {
+            if (x[n] == 0) {
+                continue;
+            }
+            const double* row = &trans[n*K];
+            for (int m=0; m<K; m++) {
+                y[m] += x[n] * row[m];
             }
         }
+        return;
     }
-    for (int n=0; n<this->nbasins; n++) {
-        double norm = 0;
-        for (int m=0; m<this->nbasins; m++) {
-            norm += num[n*this->nbasins+m];
+    if (transpose) {
+        for (int m=0; m<K; m++) {
+            y[m] = 0;
         }
-        for (int m=0; m<this->nbasins; m++) {
-            trans[n*this->nbasins+m] = num[n*this->nbasins+m]/norm;
+        for (int n=0; n<K; n++) {
+            if (x[n] == 0) {
+                continue;
+            }
+            for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+                y[trans_col[j]] += trans_val[j] * x[n];
+            }
+        }
+    } else {
+        for (int n=0; n<K; n++) {
+            double sum = 0;
+            for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+                sum += trans_val[j] * x[trans_col[j]];
+            }
+            y[n] = sum;
         }
     }
     return;
 }
 
 template <class BasinT>
-void HMM<BasinT>::update_P() {
+vector<double> HMM<BasinT>::log_trans_values() const {
+    // log trans, as the dense K x K matrix or as the CSR values, for trans_max_plus()
+    const vector<double>& vals = trans_row.empty() ? trans : trans_val;
+    vector<double> log_vals (vals.size());
+    for (int i=0; i<vals.size(); i++) {
+        log_vals[i] = log(vals[i]);
+    }
+    return log_vals;
+}
 
-    for (state_iter it=this->train_states.begin(); it != this->train_states.end(); ++it) {
-        State& this_state = it->second;
-        this_state.weight.assign(this->nbasins,0);
+template <class BasinT>
+void HMM<BasinT>::trans_max_plus(const double* log_vals, const double* w, double* v, int* arg) const {
+    // v[n] = max_m ( log trans[n,m] + w[m] ) with the first maximising m in arg[n]
+    int K = this->nbasins;
+    if (trans_row.empty()) {
+        for (int n=0; n<K; n++) {
+            v[n] = max_plus(&log_vals[n*K], w, K, arg[n]);
+        }
+        return;
     }
-    
-    vector<double> denom  (this->nbasins,0);
-    int nsamp = 0;
-    vector<double>  this_P (this->nbasins,0);
-    for (int t=0; t<T; t+=tskip) {
-//        State& this_state = this->train_states.at(words[t]);
-        if (state_list[t]) {
-            State& this_state = *state_list[t];
-            
-            double norm = 0;
-            for (int i=0; i<this->nbasins; i++) {
-                this_P[i] = forward[t*this->nbasins + i] * backward[t*this->nbasins + i];
-                norm += this_P[i];
+    for (int n=0; n<K; n++) {
+        double best = -numeric_limits<double>::infinity();
+        arg[n] = trans_col[trans_row[n]];
+        for (int j=trans_row[n]; j<trans_row[n+1]; j++) {
+            double x = log_vals[j] + w[trans_col[j]];
+            if (x > best) {
+                best = x;
+                arg[n] = trans_col[j];
             }
-            for (int i=0; i<this->nbasins; i++) {
-                this_P[i] /= norm;
-                
-                //double delta = this_P[i] - this_state.weight[i];
-               // this_state.weight[i] += delta / (i+1);
-                this_state.weight[i] += this_P[i];
-                //denom[i] += this_P[i];
-//                denom[i] += (delta_denom / ((t/tskip)+1));
-                double delta_denom = this_P[i] - denom[i];
-                denom[i] += (delta_denom / (nsamp+1));
-            }
-            nsamp++;
+        }
+        v[n] = best;
+    }
+    return;
+}
+
+template <class BasinT>
+double HMM<BasinT>::joint_logli() {
+    // log P(observed and held-out bins): the normalisers of the prediction
+    // recursion of update_backward() with the held-out emissions switched on,
+    // so log P(held-out | observed) is this minus the observed log-likelihood.
+    // Runs of observed bins are crossed as in backward_range(); held-out runs
+    // are stepped bin by bin. Dense in the modes, also with the beam on.
+    int K = this->nbasins;
+    vector<double> pred (K);
+    vector<double> last_pred (K);
+    vector<double> scaled (K);
+    double logli = 0;
+    int r = 0;
+    for (int t=0; t<T; t+=tskip) {
+        if (new_trial[t]) {
+            copy(w0.begin(), w0.end(), pred.begin());
+        } else {
+            trans_apply(true, scaled.data(), pred.data());
+            normalize_probs(pred.data(), K);
+        }
+        while (r < runs.size() && runs[r].start < t) {
+            r++;
+        }
+        if (r < runs.size() && t == runs[r].start && state_list[t]) {
+            int last = t + runs[r].len - 1;
+            run_power_apply(state_list[t], runs[r].len - 1, true, pred.data(), last_pred.data());
+            logli += log(normalize_probs(last_pred.data(), K)) + (runs[r].len - 1) * run_log_rho.find(state_list[t])->second;
+            pred.swap(last_pred);
+            t = last;
+        }
+        const double* e = state_list[t] ? emiss_at(t) : emiss_obs(false, t);
+        double c = 0;
+        for (int k=0; k<K; k++) {
+            scaled[k] = e[k] * pred[k];
+            c += scaled[k];
+        }
+        logli += log(c);
+    }
+    return logli;
+}
+
+template <class BasinT>
+void HMM<BasinT>::finish_P(vector<double>& denom) {
+    for (map<State*, vector<double> >::iterator it=run_occupancy.begin(); it!=run_occupancy.end(); ++it) {
+        for (int i=0; i<this->nbasins; i++) {
+            (it->first)->weight[i] += (it->second)[i];
+            denom[i] += (it->second)[i];
         }
     }
     
@@ -1769,260 +3818,644 @@ void HMM<BasinT>::update_P() {
         State& this_state = it->second;
         for (int i=0; i<this->nbasins; i++) {
 //            this_state.weight[i] /= (ceil(T/tskip)*denom[i]);
-            this_state.weight[i] /= (nsamp*denom[i]);
+            this_state.weight[i] /= denom[i];
 //            this_state.weight[i] /= (denom[i]);
-            this_state.P[i] = this->basins[i].P_state(this_state);
         }
     }
+    this->update_emiss(this->train_states);
+    this->update_emiss(heldout_states);
+
+    return;
+}
+
+/*
+template <class BasinT>
+vector<char> HMM<BasinT>::get_raster() {
+    
+    vector<char> raster (T*this->N, 0);
+    for (int t=0; t<T; t++) {
+        string this_str = words[t];
+        for (int n=0; n<this->N; n++) {
+            raster[t*this->N + n] = this_str[n];
+        }
+    }
+    return raster;
+}
+*/
+
+template <class BasinT>
+vector<double> HMM<BasinT>::get_P() {
+    if (!checkpoints.empty()) {
+        return checkpointed_output(2);
+    }
+    refresh_forward_backward();
+    vector<double> P (T*this->nbasins);
+    for (int t=0; t<T; t++) {
+        double norm = 0;
+        for (int n=0; n<this->nbasins; n++) {
+            P[t*this->nbasins+n] = forward[t*this->nbasins+n]*backward[t*this->nbasins+n];
+            norm += P[t*this->nbasins+n];
+        }
+        for (int n=0; n<this->nbasins; n++) {
+            P[t*this->nbasins+n] /= norm;
+        }
+    }
+    return P;
+}
+
+template <class BasinT>
+vector<double> HMM<BasinT>::P_indep() {
+    vector<double> P (T*this->nbasins);
+    for (int t=0; t<T; t++) {
+        double norm = 0;        
+        for (int n=0; n<this->nbasins; n++) {
+            P[t*this->nbasins+n] = this->w[n] * state_list[t]->P[n];
+            norm += P[t*this->nbasins+n];
+        }
+        for (int n=0; n<this->nbasins; n++) {
+            P[t*this->nbasins+n] /= norm;
+        }
+
+    }
+    return P;
+}
+
+template <class BasinT>
+vector<double> HMM<BasinT>::get_trans() {
+    return trans;
+}
+
+template<class BasinT>
+const double* HMM<BasinT>::emiss_obs(bool obs, int t) const {
+    // Emissions of the observed bins (obs = true) or of the held-out bins
+    // (obs = false, from heldout_states); the other bins get all ones
+    State* this_state = obs ? state_list[t] : heldout_list[t];
+    return this_state ? (this_state->P).data() : unit_emiss.data();
+}
+
+template <class BasinT>
+vector<int> HMM<BasinT>::viterbi(bool obs) {
+    // Most likely basin sequence given the observed bins (obs = true) or the
+    // held-out bins only (obs = false)
+    int K = this->nbasins;
+    vector<double> log_trans = log_trans_values();
+    map<State*, vector<double> > log_P;      // log emissions of each state, on first use
+    vector<double> log_unit (K, 0);
+    vector<double> scored (K);
+    vector<double> beam_scratch;
+    vector<int> beam_modes;
+    auto log_emiss = [&](int t) -> const double* {
+        State* this_state = obs ? state_list[t] : heldout_list[t];
+        if (!this_state) {
+            return log_unit.data();
+        }
+        vector<double>& this_log_P = log_P[this_state];
+        if (this_log_P.empty()) {
+            this_log_P.resize(K);
+            for (int k=0; k<K; k++) {
+                this_log_P[k] = log((this_state->P)[k]);
+            }
+        }
+        return this_log_P.data();
+    };
+    
+    vector<double> log_w0 (K);
+    vector<double> log_start (K);
+    const double* e0 = log_emiss(0);
+    for (int k=0; k<K; k++) {
+        log_w0[k] = log(w0[k]);
+        log_start[k] = log_w0[k] + e0[k];
+    }
+    return viterbi_path(T, checkpoints, log_start.data(), [&](int t, const double* v_next, double* v, int* arg) {
+        const double* e = log_emiss(t);
+        for (int m=0; m<K; m++) {
+            scored[m] = e[m] + v_next[m];
+        }
+        if (new_trial[t]) {
+            // A new trial starts from w0 whatever the basin before it
+            int a;
+            double best = max_plus(log_w0.data(), scored.data(), K, a);
+            for (int n=0; n<K; n++) {
+                v[n] = best;
+                arg[n] = a;
+            }
+            return;
+        }
+        if (beam_rel > 0 || beam_width > 0) {
+            // Beam: drop the modes more than log(1/beam_rel) below the best
+            // score, or outside the beam_width best, O(K B) per bin
+            double best = *max_element(scored.begin(), scored.end());
+            double floor_value = (beam_rel > 0) ? best + log(beam_rel) : -numeric_limits<double>::infinity();
+            double cutoff = beam_cutoff(scored.data(), K, beam_width, floor_value, beam_scratch);
+            beam_modes.clear();
+            for (int m=0; m<K; m++) {
+                if (scored[m] >= cutoff) {
+                    beam_modes.push_back(m);
+                } else {
+                    scored[m] = -numeric_limits<double>::infinity();
+                }
+            }
+            if (trans_row.empty()) {
+                for (int n=0; n<K; n++) {
+                    const double* row = &log_trans[n*K];
+                    v[n] = -numeric_limits<double>::infinity();
+                    arg[n] = beam_modes[0];
+                    for (int i=0; i<beam_modes.size(); i++) {
+                        double x = row[beam_modes[i]] + scored[beam_modes[i]];
+                        if (x > v[n]) {
+                            v[n] = x;
+                            arg[n] = beam_modes[i];
+                        }
+                    }
+                }
+                return;
+            }
+        }
+        trans_max_plus(log_trans.data(), scored.data(), v, arg);
+    });
+}
+
+template <class BasinT>
+template <class Step>
+vector<int> HMM<BasinT>::viterbi_path(int nbins, const vector<int>& segments, const double* log_start, Step step) {
+    // Backpointers as narrow as K allows
+    if (this->nbasins <= 256) {
+        return viterbi_scan<uint8_t>(nbins, segments, log_start, step);
+    }
+    return viterbi_scan<uint16_t>(nbins, segments, log_start, step);
+}
+
+template <class BasinT>
+template <class Index, class Step>
+vector<int> HMM<BasinT>::viterbi_scan(int nbins, const vector<int>& segments, const double* log_start, Step step) {
+    // Log-space max-product over the bins from T-1 down to 1 (T = nbins),
+    //    v_t[n] = max_m ( log P(z_t = m | z_(t-1) = n, bin t) + v_(t+1)[m] ),   v_T = 0,
+    // the best log-probability of bins t..T-1 given the basin at t-1. step(t,
+    // v_(t+1), v_t, arg) computes v_t and its argmax for one bin. z_0
+    // maximises log_start + v_1 and the path is read forward from the
+    // backpointers. Given segment boundaries (the checkpoints of
+    // set_checkpoints) a first pass keeps v only at the segment starts, and
+    // each segment's backpointers are redone just before the path goes through
+    // it: memory O(K (nseg + longest segment)). No segments: one segment [0,T).
+    int K = this->nbasins;
+    vector<int> bounds (segments);
+    if (bounds.empty()) {
+        bounds.push_back(0);
+        bounds.push_back(nbins);
+    }
+    int nseg = bounds.size() - 1;
+    int max_len = 0;
+    for (int c=0; c<nseg; c++) {
+        max_len = max(max_len, bounds[c+1] - bounds[c]);
+    }
+    vector<double> saved ((nseg+1)*K, 0);
+    vector<double> v (K);
+    vector<double> v_next (K, 0);
+    vector<int> arg (K);
+    vector<Index> backptr ((long) max_len*K);
+    for (int c=nseg-1; c>0; c--) {
+        for (int t=bounds[c+1]-1; t>=bounds[c]; t--) {
+            step(t, v_next.data(), v.data(), arg.data());
+            v_next.swap(v);
+        }
+        copy(v_next.begin(), v_next.end(), saved.begin() + c*K);
+    }
+    
+    vector<int> path (nbins, 0);
+    for (int c=0; c<nseg; c++) {
+        int t0 = bounds[c];
+        int t_first = max(t0, 1);
+        copy(saved.begin() + (c+1)*K, saved.begin() + (c+2)*K, v_next.begin());
+        for (int t=bounds[c+1]-1; t>=t_first; t--) {
+            step(t, v_next.data(), v.data(), arg.data());
+            v_next.swap(v);
+            for (int n=0; n<K; n++) {
+                backptr[(long) (t-t0)*K + n] = (Index) arg[n];
+            }
+        }
+        if (c == 0) {
+            // v_next is v_1
+            max_plus(log_start, v_next.data(), K, path[0]);
+        }
+        for (int t=t_first; t<bounds[c+1]; t++) {
+            path[t] = backptr[(long) (t-t0)*K + path[t-1]];
+        }
+    }
+    return path;
+}
+
+template <class BasinT>
+vector<HMMScore> HMM<BasinT>::score(const vector<vector<vector<double> > >& recordings, const vector<double>& durations, double binsize, bool posteriors, int nthreads) {
+    // Scores new recordings with the trained model, leaving it untouched:
+    // recordings[r][n] holds the spike times of neuron n, cut to
+    // floor(durations[r]/binsize) bins. For each recording:
+    //  - logli, the exact log-likelihood, from the normalisers of the
+    //    prediction pass pred[t] = trans^T (e_(t-1) .* pred[t-1]), pred[0] = w0
+    //  - path, the Viterbi path (viterbi_path())
+    //  - P, the T x K posteriors, if posteriors is set
+    // Recordings run concurrently on nthreads threads (0: all cores); the
+    // basins are only read, through P_state.
+    int K = this->nbasins;
+    vector<HMMScore> out (recordings.size());
+    vector<double> log_trans = log_trans_values();
+    vector<double> log_w0 (K);
+    for (int k=0; k<K; k++) {
+        log_w0[k] = log(w0[k]);
+    }
+    parallel_for(recordings.size(), nthreads, [&](int r) {
+        HMMScore& result = out[r];
+        int nbins = floor(durations[r] / binsize);
+        if (nbins <= 0) {
+            result.logli = 0;
+            return;
+        }
+        
+        // Distinct words of the recording and the word of each bin
+        int nlanes = word_nlanes(this->N);
+        vector<word_lane> words ((long) nbins*nlanes, 0);
+        vector<Spike> spikes = this->sort_spikes(recordings[r], binsize);
+        for (vector<Spike>::iterator it=spikes.begin(); it!=spikes.end(); ++it) {
+            if (it->bin >= 0 && it->bin < nbins) {
+                words[(long) it->bin*nlanes + it->neuron_ind / word_lane_bits] |= ((word_lane) 1) << (it->neuron_ind % word_lane_bits);
+            }
+        }
+        map<word_key, int, WordLess> word_ind;
+        vector<int> bin_state (nbins);
+        for (int t=0; t<nbins; t++) {
+            word_key bin_key (words.begin() + (long) t*nlanes, words.begin() + (long) (t+1)*nlanes);
+            bin_state[t] = word_ind.insert(pair<word_key,int> (bin_key, word_ind.size())).first->second;
+        }
+        vector<State> states (word_ind.size());
+        vector<State*> state_ptrs (word_ind.size());
+        for (map<word_key, int, WordLess>::iterator it=word_ind.begin(); it!=word_ind.end(); ++it) {
+            State& this_state = states[it->second];
+            this_state.word.assign(this->N, 0);
+            this_state.bits = it->first;
+            for_each_on<0>(this_state.bits.data(), nlanes, [&](int n) {
+                this_state.on_neurons.push_back(n);
+                this_state.word[n] = 1;
+            });
+            state_ptrs[it->second] = &this_state;
+        }
+        vector<double> emiss (states.size() * K);
+        P_state_batch(this->basins, state_ptrs, emiss.data());
+        
+        // Prediction pass, and the backward-in-time pass (the forward array of train())
+        vector<double> pred ((long) nbins*K);
+        vector<double> scaled (K);
+        result.logli = 0;
+        copy(w0.begin(), w0.end(), pred.begin());
+        for (int t=0; t<nbins; t++) {
+            const double* e = &emiss[bin_state[t]*K];
+            double* this_pred = &pred[(long) t*K];
+            for (int k=0; k<K; k++) {
+                scaled[k] = e[k] * this_pred[k];
+            }
+            result.logli += log(normalize_probs(scaled.data(), K));
+            if (t+1 < nbins) {
+                trans_apply(true, scaled.data(), this_pred + K);
+                normalize_probs(this_pred + K, K);
+            }
+        }
+        if (posteriors) {
+            result.P.assign((long) nbins*K, 0);
+            vector<double> fw (K);
+            vector<double> next_fw (K);
+            for (int t=nbins-1; t>=0; t--) {
+                const double* e = &emiss[bin_state[t]*K];
+                if (t == nbins-1) {
+                    copy(e, e+K, fw.begin());
+                } else {
+                    trans_apply(false, next_fw.data(), fw.data());
+                    for (int k=0; k<K; k++) {
+                        fw[k] *= e[k];
+                    }
+                }
+                normalize_probs(fw.data(), K);
+                double* this_P = &result.P[(long) t*K];
+                for (int k=0; k<K; k++) {
+                    this_P[k] = fw[k] * pred[(long) t*K + k];
+                }
+                normalize_probs(this_P, K);
+                next_fw.swap(fw);
+            }
+        }
+        
+        vector<double> log_emiss (emiss.size());
+        for (int i=0; i<emiss.size(); i++) {
+            log_emiss[i] = log(emiss[i]);
+        }
+        vector<double> log_start (K);
+        vector<double> scored (K);
+        for (int k=0; k<K; k++) {
+            log_start[k] = log_w0[k] + log_emiss[bin_state[0]*K + k];
+        }
+        result.path = viterbi_path(nbins, vector<int>(), log_start.data(), [&](int t, const double* v_next, double* v, int* arg) {
+            const double* e = &log_emiss[bin_state[t]*K];
+            for (int m=0; m<K; m++) {
+                scored[m] = e[m] + v_next[m];
+            }
+            trans_max_plus(log_trans.data(), scored.data(), v, arg);
+        });
+    });
+    return out;
+}
+
+template <class BasinT>
+HMMStream<BasinT> HMM<BasinT>::stream(double binsize, int lag) const {
+    // Online decoder holding a copy of the trained parameters, see HMMStream
+    return HMMStream<BasinT>(this->N, this->basins, trans, w0, binsize, lag);
+}
+
+template <class BasinT>
+HMMStream<BasinT>::HMMStream(int N, const vector<BasinT>& basins, const vector<double>& trans, const vector<double>& w0, double binsize, int lag) : N (N), K (w0.size()), lag (max(lag, 0)), binsize (binsize), basins (basins), trans (trans), w0 (w0), pred (K), filt (K) {
+    nring = max(2*this->lag, 1);
+    emiss_ring.assign(nring*K, 0);
+    filt_ring.assign(nring*K, 0);
+    filt_out.reserve(nring*K);
+    smooth_out.reserve(nring*K);
+    back.assign(K, 0);
+    back_next.assign(K, 0);
+    open_state.word.assign(N, 0);
+    open_state.on_neurons.reserve(N);
+    pack_word(open_state.word, open_state.bits);
+    reset();
+}
+
+template <class BasinT>
+void HMMStream<BasinT>::reset() {
+    t = 0;
+    log_li = 0;
+    nlate = 0;
+    call_closed = false;
+    call_smoothed = false;
+    filt_begin = 0;
+    filt_out.clear();
+    smooth_begin = 0;
+    smooth_end = 0;
+    smooth_out.clear();
+    copy(w0.begin(), w0.end(), pred.begin());
+    copy(w0.begin(), w0.end(), filt.begin());
+    for (int i=0; i<open_state.on_neurons.size(); i++) {
+        open_state.word[open_state.on_neurons[i]] = 0;
+    }
+    open_state.on_neurons.clear();
+    return;
+}
 
+template <class BasinT>
+void HMMStream<BasinT>::begin_call() {
+    // The outputs of the previous call stay readable until this one closes
+    // (or smooths) its first bin
+    call_closed = false;
+    call_smoothed = false;
     return;
 }
 
 template <class BasinT>
-double HMM<BasinT>::logli(bool obs) {
-    vector<int> alpha = viterbi(obs);
-//    State& init_state = this->train_states.at(words[0]);
-    vector<double> emiss = emiss_obs(obs, tskip-1);
-    // don't use epsilon ~ 10^-16, use min ~ 10^-308
-    // see https://en.cppreference.com/w/cpp/types/numeric_limits
-    //modified line
-    //double logmin = log( std::numeric_limits<double>::min() );
-    double logmin =  std::numeric_limits<double>::min();
-    //cout << "logmin" << logmin;
-    double logli = log(w0[alpha[tskip-1]] * emiss[alpha[tskip-1]]);
-    // Aditya note: w0 ~= 0 or emiss ~= 0 causes -inf, thence nan's,
-    //  so lower bound to min representable positive number
-    if (std::isinf(logli)) {
-        logli = logmin;
+void HMMStream<BasinT>::push_spike(double time, int neuron) {
+    begin_call();
+    int bin = floor(time / binsize);
+    if (bin < t || neuron < 0 || neuron >= N) {
+        nlate += (bin < t);
+        return;
     }
-    for (int t=2*tskip-1; t<T; t+=tskip) {
-//        State& this_state = this->train_states.at(words[t]);
-        emiss = emiss_obs(obs, t);
-        // Aditya notes: why subtract -logli at each time step!?
-        // Basically, they're doing an online i.e. running mean as each data point arrives (useful if tskip > 1).
-        // At time step t, suppose mean was correct, i.e. already divided by t,
-        //  then at time step t+1, you want the previous mean to be multiplied by t/(t+1) to get an overall /(t+1).
-        // mean_0 = val_0
-        // mean_{t+1} = val_{t+1} /(t+1) + mean_t * t/(t+1) 
-        //            =  val_{t+1} /(t+1) + mean_t (1 - 1/(t+1))
-        //            = ( val_{t+1} - mean_t )/(t+1) + mean_t
-        //            = delta_{t+1} /(t+1) + mean_t,     where delta_{t+1} = val_{t+1} - mean_t
-        double logemiss = log(emiss[alpha[t]]);
-        // Aditya note: emiss or trans ~= 0 causes -inf, thence nan's,
-        //  so lower bound to min representable positive number
-        if (std::isinf(logemiss)) {
-            logemiss = logmin;
-        }
-        double logtrans = log(trans[alpha[t-tskip]*this->nbasins + alpha[t]]);
-        if (std::isinf(logtrans)) {
-            logtrans = logmin;
-        }
-        double delta = logtrans + logemiss - logli;
-        // Aditya notes: for non-running mean, below RHS is val_{t+1} in explanation above
-        //double delta = log(trans[alpha[t-tskip]*this->nbasins + alpha[t]]) + log(emiss[alpha[t]]);
-
-        logli += delta / (((t-1)/tskip)+1);
-        // logli += delta;  // Aditya notes: for non-running mean (assumed tskip=1)
+    while (t < bin) {
+        close_bin();
     }
-    return logli;
-    //return logli/T;       // Aditya notes: normalize at end for non-running mean
-    
-//    State& final_state = this->train_states.at(words[T-1]);
-//    vector<double> logli (this->nbasins, 0);
-//    for (int n=0; n<this->nbasins; n++) {
-//        logli[n] = log(final_state.P[n]);
-//    }
-//
-//    for (int t=T-2; t>=0; t--) {
-//        vector<double> tmp_logli = logli;
-//        State& this_state = this->train_states[words[t]];
-//        for (int n=0; n<this->nbasins; n++) {            
-//            double tmp = 0;
-//            for (int m=0; m<this->nbasins; m++) {
-//                tmp += trans[n*this->nbasins + m] * exp(tmp_logli[m]);
-//            }
-//            logli[n] = log(this_state.P[n]) + log(tmp);
-//        }        
-//    }
-//
-//    double li = 0;
-//    for (int n=0; n<this->nbasins; n++) {
-//        li += exp(logli[n])*w0[n];
-//    }
-//    return log(li);
+    if (!open_state.word[neuron]) {
+        open_state.word[neuron] = 1;
+        open_state.on_neurons.push_back(neuron);
+    }
+    return;
 }
 
-/*
 template <class BasinT>
-vector<char> HMM<BasinT>::get_raster() {
-    
-    vector<char> raster (T*this->N, 0);
-    for (int t=0; t<T; t++) {
-        string this_str = words[t];
-        for (int n=0; n<this->N; n++) {
-            raster[t*this->N + n] = this_str[n];
-        }
+void HMMStream<BasinT>::advance(double time) {
+    begin_call();
+    while ((t+1) * binsize <= time) {
+        close_bin();
     }
-    return raster;
+    return;
 }
-*/
 
 template <class BasinT>
-vector<double> HMM<BasinT>::get_P() {
-    vector<double> P (T*this->nbasins);
-    for (int t=0; t<T; t++) {
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            P[t*this->nbasins+n] = forward[t*this->nbasins+n]*backward[t*this->nbasins+n];
-            norm += P[t*this->nbasins+n];
-        }
-        for (int n=0; n<this->nbasins; n++) {
-            P[t*this->nbasins+n] /= norm;
+void HMMStream<BasinT>::push_word(const char* word) {
+    begin_call();
+    for (int i=0; i<open_state.on_neurons.size(); i++) {
+        open_state.word[open_state.on_neurons[i]] = 0;
+    }
+    open_state.on_neurons.clear();
+    for (int n=0; n<N; n++) {
+        if (word[n]) {
+            open_state.word[n] = 1;
+            open_state.on_neurons.push_back(n);
         }
     }
-    return P;
+    close_bin();
+    return;
 }
 
 template <class BasinT>
-vector<double> HMM<BasinT>::P_indep() {
-    vector<double> P (T*this->nbasins);
-    for (int t=0; t<T; t++) {
-        double norm = 0;        
-        for (int n=0; n<this->nbasins; n++) {
-            P[t*this->nbasins+n] = this->w[n] * state_list[t]->P[n];
-            norm += P[t*this->nbasins+n];
-        }
-        for (int n=0; n<this->nbasins; n++) {
-            P[t*this->nbasins+n] /= norm;
-        }
-
+void HMMStream<BasinT>::close_bin() {
+    // Filtering step: pred = trans^T filt_(t-1) (w0 for the first bin),
+    // filt_t ~ e_t .* pred; the word is then cleared for the next bin
+    sort(open_state.on_neurons.begin(), open_state.on_neurons.end());
+    for (int l=0; l<open_state.bits.size(); l++) {
+        open_state.bits[l] = 0;
     }
-    return P;
+    for (int i=0; i<open_state.on_neurons.size(); i++) {
+        int n = open_state.on_neurons[i];
+        open_state.bits[n / word_lane_bits] |= ((word_lane) 1) << (n % word_lane_bits);
+    }
+    double* e = &emiss_ring[(t % nring)*K];
+    for (int k=0; k<K; k++) {
+        e[k] = basins[k].P_state(open_state);
+    }
+    if (t > 0) {
+        trans_gemv(true, trans.data(), filt.data(), pred.data(), K);
+    }
+    for (int k=0; k<K; k++) {
+        filt[k] = e[k] * pred[k];
+    }
+    log_li += log(normalize_probs(filt.data(), K));
+    copy(filt.begin(), filt.end(), filt_ring.begin() + (t % nring)*K);
+    if (!call_closed) {
+        call_closed = true;
+        filt_begin = t;
+        filt_out.clear();
+    }
+    filt_out.insert(filt_out.end(), filt.begin(), filt.end());
+    
+    for (int i=0; i<open_state.on_neurons.size(); i++) {
+        open_state.word[open_state.on_neurons[i]] = 0;
+    }
+    open_state.on_neurons.clear();
+    t++;
+    if (lag > 0 && t % lag == 0 && t >= 2*lag) {
+        smooth_to(t - lag);
+    }
+    return;
 }
 
 template <class BasinT>
-vector<double> HMM<BasinT>::get_trans() {
-    return trans;
+void HMMStream<BasinT>::finish() {
+    begin_call();
+    if (lag > 0 && smooth_end < t) {
+        smooth_to(t);
+    }
+    return;
 }
 
-template<class BasinT>
-vector<double> HMM<BasinT>::emiss_obs(bool obs, int t) {
-   
- if (state_list[t] && obs) {
-        return state_list[t]->P;
-	} else if (!state_list[t] && !obs) {
-        vector<double> emiss (this->nbasins, 1);
-        State this_state;
-        this_state.word.assign(this->N, 0);
-        for (int n=0; n<this->N; n++) {
-            if ((this->raster[t])[n] == '1') {
-                this_state.on_neurons.push_back(n);
-                this_state.word[n] = 1;
+template <class BasinT>
+void HMMStream<BasinT>::smooth_to(int end) {
+    // Posteriors of bins [smooth_end, end) given bins 0..t-1, from one
+    // backward pass over the ring, back_s ~ trans (e_(s+1) .* back_(s+1)),
+    // back_(t-1) = 1: at most 2*lag steps for lag bins. Blocks smoothed by
+    // the same call are appended to smooth_out
+    if (!call_smoothed) {
+        call_smoothed = true;
+        smooth_begin = smooth_end;
+        smooth_out.clear();
+    }
+    smooth_out.resize((end - smooth_begin)*K);
+    for (int k=0; k<K; k++) {
+        back[k] = 1;
+    }
+    for (int s=t-1; s>=smooth_end; s--) {
+        if (s < end) {
+            const double* f = &filt_ring[(s % nring)*K];
+            double* p = &smooth_out[(s - smooth_begin)*K];
+            for (int k=0; k<K; k++) {
+                p[k] = f[k] * back[k];
             }
+            normalize_probs(p, K);
         }
-        for (int k=0; k<this->nbasins; k++) {
-            emiss[k] = (this->basins)[k].P_state(this_state);
+        if (s > smooth_end) {
+            const double* e = &emiss_ring[(s % nring)*K];
+            for (int k=0; k<K; k++) {
+                back_next[k] = e[k] * back[k];
+            }
+            trans_gemv(false, trans.data(), back_next.data(), back.data(), K);
+            normalize_probs(back.data(), K);
         }
-        return emiss;
     }
-    return vector<double> (this->nbasins,1);
-
+    smooth_end = end;
+    return;
 }
 
 template <class BasinT>
-vector<int> HMM<BasinT>::viterbi(bool obs) {
-    vector<int> alpha_max (T,0);
-    vector<int> argmax (T*this->nbasins, 0);
-
-    vector<double> max (this->nbasins, 1);
-    vector<double> emiss (this->nbasins);
-    for (int t=(T-(T%tskip)-1); t>=(tskip-1); t-=tskip) {
-//        State& this_state = this->train_states.at(words[t]);
-        emiss = emiss_obs(obs,t);
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            double this_max = 0;
-            int this_arg = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                double tmp = emiss[m] * trans[n*this->nbasins+m] * max[m];
-//                if (state_list[t]) {
-//                    tmp = (state_list[t]->P)[m] * trans[n*this->nbasins+m] * max[m];
-//                } else {
-//                    tmp = trans[n*this->nbasins+m] * max[m];
-//                }
-                
-                if (tmp > this_max) {
-                    this_max = tmp;
-                    this_arg = m;
-                }
-            }
-            max[n] = this_max;
-            norm += this_max;
-            argmax[t*this->nbasins + n] = this_arg;
-        }
-        for (int n=0; n<this->nbasins; n++) {
-            max[n] /= norm;
-        }
+const double* HMMStream<BasinT>::filtered(int bin) const {
+    if (bin < filt_begin || bin >= t) {
+        return NULL;
     }
-//    State& this_state = this->train_states.at(words[0]);
-    double this_max = 0;
-    int this_arg = 0;
-    emiss = emiss_obs(obs,tskip-1);
-    for (int m=0; m<this->nbasins; m++) {
-        double tmp = emiss[m] * w0[m] * max[m];
-        if (tmp > this_max) {
-            this_max = tmp;
-            this_arg = m;
-        }
+    return &filt_out[(bin - filt_begin)*K];
+}
+
+template <class BasinT>
+const double* HMMStream<BasinT>::smoothed(int bin) const {
+    if (bin < smooth_begin || bin >= smooth_end) {
+        return NULL;
     }
-    alpha_max[tskip-1] = this_arg;
-    for (int t=2*tskip-1; t<T; t+=tskip) {
-        alpha_max[t] = argmax[t*this->nbasins + alpha_max[t-tskip]];
+    return &smooth_out[(bin - smooth_begin)*K];
+}
+
+template <class BasinT>
+void HMM<BasinT>::markov_refresh() {
+    // Drops the cached summaries if trans or w0 changed since they were computed
+    if (markov_trans != trans || markov_w0 != w0) {
+        markov_trans = trans;
+        markov_w0 = w0;
+        markov_pi.clear();
+        markov_lambda2 = -1;
+        markov_eps = -1;
     }
-    
-    return alpha_max;
+    return;
 }
 
 template <class BasinT>
 vector<double> HMM<BasinT>::stationary_prob() {
-    // Stationary basin probability
-    vector<double> trans_pow = mpow(trans, this->nbasins, 1000);
-    vector<double> w (this->nbasins,0);
-    for (int i=0; i<this->nbasins; i++) {
-        for (int j=0; j<this->nbasins; j++) {
-            w[i] += trans_pow[(this->nbasins)*j+i]*w0[j];
-        }
+    // Stationary basin probability, the long-run limit started from w0
+    markov_refresh();
+    if (markov_pi.empty()) {
+        markov_pi = markov_stationary(trans.data(), w0.data(), this->nbasins);
+    }
+    return markov_pi;
+}
+
+template <class BasinT>
+double HMM<BasinT>::spectral_gap() {
+    markov_refresh();
+    if (markov_lambda2 < 0) {
+        markov_lambda2 = markov_second_eigenvalue(trans.data(), stationary_prob().data(), this->nbasins);
+    }
+    return 1 - markov_lambda2;
+}
+
+template <class BasinT>
+long HMM<BasinT>::mixing_time(double eps) {
+    vector<double> pi = stationary_prob();
+    if (markov_eps != eps) {
+        markov_tmix = markov_mixing_time(trans.data(), pi.data(), this->nbasins, eps);
+        markov_eps = eps;
     }
-    return w;
+    return markov_tmix;
 }
 
 
 template <class BasinT>
 vector<char> HMM<BasinT>::sample(int nsamples) {
-    vector<char> samples (this->N*nsamples);
-    int basin_ind = (this->rng)->discrete(w0);
-    vector<char> this_sample = (this->basins)[basin_ind].sample();
-    for (int n=0; n<this->N; n++) {
-        samples[n] = this_sample[n];
-    }
-    for (int t=1; t<nsamples; t++) {
-        vector<double> this_trans (this->nbasins);
-        for (int k=0; k<this->nbasins; k++) {
-            this_trans[k] = trans[basin_ind*this->nbasins + k];
-        }
-        basin_ind = (this->rng)->discrete(this_trans);
-        this_sample = (this->basins)[basin_ind].sample();
+    // Seed drawn from the model's RNG, so that repeated calls give fresh samples
+    return sample(nsamples, (this->rng)->get(), default_nthreads());
+}
+
+template <class BasinT>
+vector<char> HMM<BasinT>::sample(int nsamples, unsigned long seed, int nthreads, int nchains) {
+    // The nsamples bins are split into nchains independent chains started from
+    // w0 (one chain reproduces a single long sequence). The hidden chains are
+    // run first with alias tables for w0 and each row of trans, then the words
+    // are drawn in blocks given the basin sequence. Chain c uses RNG stream c,
+    // word block b uses stream nchains+b, so the output is reproducible for a
+    // given seed whatever the number of threads.
+    int K = this->nbasins;
+    vector<char> samples ((long) this->N*nsamples);
+    vector<int> basin_ind (nsamples);
+    
+    AliasTable w0_alias (w0.data(), K);
+    vector<AliasTable> trans_alias (K);
+    for (int k=0; k<K; k++) {
+        trans_alias[k] = AliasTable(&trans[k*K], K);
+    }
+    
+    nchains = max(1, min(nchains, nsamples));
+    int chain_len = (nsamples + nchains - 1) / nchains;
+    parallel_for(nchains, nthreads, [&](int c) {
+        RNG chain_rng (seed, c);
+        int t0 = c*chain_len;
+        int t1 = min(t0 + chain_len, nsamples);
+        if (t0 >= t1) return;
+        basin_ind[t0] = w0_alias.draw(chain_rng);
+        for (int t=t0+1; t<t1; t++) {
+            basin_ind[t] = trans_alias[basin_ind[t-1]].draw(chain_rng);
+        }
+    });
+    
+    int block = this->sample_block;
+    int nblocks = (nsamples + block - 1) / block;
+    parallel_for(nblocks, nthreads, [&](int b) {
+        RNG block_rng (seed, nchains + b);
+        int s0 = b*block;
+        int s1 = min(s0 + block, nsamples);
         // Aditya notes: Careful, the samples "matrix" (nNeurons x nTimeBins)
         //  is represented as a vector here and is filled in column-major format below
         //  whereas C++ default is row-major and that's what I've assumed in writePyOutputMatrix
         //  so after passing to python, be sure to convert to row-major, else fiasco!
-        for (int n=0; n<this->N; n++) {
-            samples[t*this->N + n] = this_sample[n];
-        }
-    }
+        this->sample_words(&basin_ind[s0], s1-s0, samples.data() + (long) s0*this->N, block_rng);
+    });
     return samples;
 }
 
+
 template <class BasinT>
 pair<vector<double>, vector<double> > HMM<BasinT>::pred_prob() {
     
@@ -2031,12 +4464,7 @@ pair<vector<double>, vector<double> > HMM<BasinT>::pred_prob() {
         if (state_list[t]) {
             State this_state = *(state_list[t]);
             this_state.freq = 0;
-            vector<char> this_word = this_state.word;
-            string this_str (this_word.size(), '0');
-            for (int i=0; i<this_word.size(); i++) {
-                this_str[i] = this_word[i];
-            }
-            pair<map<string, State>::iterator, bool> ins = this->test_states.insert(pair<string,State> (this_str, this_state));
+            pair<state_iter, bool> ins = this->test_states.insert(pair<word_key,State> (this_state.bits, this_state));
             State& inserted_state = (ins.first)->second;
             inserted_state.freq++;
         }
@@ -2047,7 +4475,7 @@ pair<vector<double>, vector<double> > HMM<BasinT>::pred_prob() {
     vector<double> freq (this->test_states.size(), 0);
     int ix = 0;
 
-    for (map<string, State>::iterator it = (this->test_states).begin(); it != (this->test_states).end(); ++it) {
+    for (state_iter it = (this->test_states).begin(); it != (this->test_states).end(); ++it) {
         for (int i=0; i<this->nbasins; i++) {
             double this_P = this->basins[i].P_state(it->second);
             prob[ix] += w[i] * this_P;
@@ -2063,85 +4491,135 @@ pair<vector<double>, vector<double> > HMM<BasinT>::pred_prob() {
 
 
 template <class BasinT>
-Autocorr<BasinT>::Autocorr(vector<vector<double> >& st, double binsize, int nbasins) : HMM<BasinT>(st,vector<double>(),vector<double>(),binsize,nbasins), basin_trans (nbasins * st.size()) {
-
-    for (vector<double*>::iterator it = basin_trans.begin(); it != basin_trans.end(); ++it) {
-        *it = new double[4];
-    }
-}
+Autocorr<BasinT>::Autocorr(vector<vector<double> >& st, double binsize, int nbasins) : HMM<BasinT>(st,vector<double>(),vector<double>(),binsize,nbasins), basin_trans (4 * nbasins * st.size()) {
 
-
-template <class BasinT>
-Autocorr<BasinT>::~Autocorr() {
-    for (vector<double*>::iterator it = basin_trans.begin(); it != basin_trans.end(); ++it) {
-        delete[] *it;
+    // Autocorr's own recursions visit every bin (its transitions depend on the words)
+    this->set_min_skip_run(0);
+    
+    // Pick the self-transition kernel specialised for the population width
+    switch (this->word_width) {
+        case 1:
+            self_trans_kernel = &Autocorr<BasinT>::template self_trans<1>;
+            break;
+        case 2:
+            self_trans_kernel = &Autocorr<BasinT>::template self_trans<2>;
+            break;
+        case 4:
+            self_trans_kernel = &Autocorr<BasinT>::template self_trans<4>;
+            break;
+        default:
+            self_trans_kernel = &Autocorr<BasinT>::template self_trans<0>;
+            break;
     }
 }
 
 
 template <class BasinT>
-void Autocorr<BasinT>::update_basin_trans_indep() {
-    vector<vector<double> > basin_trans_num (this->nbasins * this->N, vector<double> (4,0));
-    vector<vector<double> > basin_trans_den (this->nbasins * this->N, vector<double> (2,0));
-    vector<double> denom  (this->nbasins,0);
-    
-    for (int t=1; t<this->T; t++) {
-        vector<double> P_joint(this->nbasins * this->nbasins, 0);
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            for (int m=0; m<this->nbasins; m++) {
-                P_joint[n*this->nbasins+m] = this->state_list[t]->P[m] * this->state_list[t-1]->P[n] * this->w[n] * this->w[m];
-                norm += P_joint[n*this->nbasins + m];
+template <class F>
+void Autocorr<BasinT>::update_basin_trans(F stay) {
+    // basin_trans[a,n][c] is the probability of code c = spike_now + 2*spike_before
+    // of neuron n given spike_before while basin a is held, estimated from
+    //    stats[a,n,c] = sum_t stay_t[a] [code of neuron n at t == c],
+    // where stay(t, P) writes stay_t, the posterior of staying in each basin
+    // from t-1 to t. Each bin only visits its flip pattern, the neurons
+    // spiking at t-1 or t; code 0 follows from the per-basin total of stay_t.
+    // Time is split into one chunk per thread, each with its own sums.
+    int K = this->nbasins;
+    int N = this->N;
+    int nbins = max(this->T - 1, 0);
+    int nchunks = max(1, min(this->time_threads, nbins));
+    vector<vector<double> > chunk_stats (nchunks);
+    vector<vector<double> > chunk_total (nchunks);
+    vector<vector<int> > chunk_prev_on (nchunks);
+    parallel_for(nchunks, nchunks, [&](int c) {
+        int t0 = 1 + (int) (((long) nbins * c) / nchunks);
+        int t1 = 1 + (int) (((long) nbins * (c+1)) / nchunks);
+        vector<double>& stats = chunk_stats[c];
+        vector<double>& total = chunk_total[c];
+        vector<int>& prev_on = chunk_prev_on[c];
+        stats.assign(4*K*N, 0);
+        total.assign(K, 0);
+        prev_on.assign(N, 0);
+        vector<double> P (K);
+        vector<int> flips;          // 4*n + code of the neurons spiking at t-1 or t
+        for (int t=t0; t<t1; t++) {
+            stay(t, P.data());
+            const State* prev = this->state_list[t-1];
+            const State* curr = this->state_list[t];
+            flips.clear();
+            for_each_flip<0>(prev->bits.data(), curr->bits.data(), curr->bits.size(), [&](int n, int code) {
+                flips.push_back(4*n + code);
+                prev_on[n] += (code >= 2);
+            });
+            for (int a=0; a<K; a++) {
+                total[a] += P[a];
+                double* this_stats = &stats[4*N*a];
+                for (int f=0; f<flips.size(); f++) {
+                    this_stats[flips[f]] += P[a];
+                }
             }
         }
-        for (int n=0; n<this->nbasins*this->nbasins; n++) {
-            P_joint[n] /= norm;
+    });
+    vector<double>& stats = chunk_stats[0];
+    vector<double>& total = chunk_total[0];
+    vector<int>& prev_on = chunk_prev_on[0];
+    for (int c=1; c<nchunks; c++) {
+        for (int i=0; i<4*K*N; i++) {
+            stats[i] += chunk_stats[c][i];
         }
-        for (int i=0; i<this->nbasins; i++) {
-            for (int n=0; n<this->N; n++) {
-                char sp_prev = (this->state_list[t-1]->word)[n];
-                char sp_this = (this->state_list[t]->word)[n];
-
-//                for (int a=0; a<4; a++) {
-//                    double delta_num = -basin_trans_num[this->N*i+n][a];
-//                    delta_num += (a == (sp_this + 2*sp_prev)) ? P_joint[i*this->nbasins+i] : 0;
-//                    basin_trans_num[this->N*i + n][a] += delta_num / (t+1);
-//                }
-//
-//                for (int a=0; a<2; a++) {
-//                    double delta_den = -basin_trans_den[this->N*i+n][a];
-//                    delta_den += (a == sp_prev) ? P_joint[i*this->nbasins+i] : 0;
-//                    basin_trans_den[this->N*i + n][a] += delta_den / (t+1);
-//                }
-                
-                basin_trans_num[this->N*i + n][sp_this + 2*sp_prev] += P_joint[i*this->nbasins+i];
-                basin_trans_den[this->N*i + n][sp_prev] += P_joint[i*this->nbasins+i];
-            }
+        for (int a=0; a<K; a++) {
+            total[a] += chunk_total[c][a];
+        }
+        for (int n=0; n<N; n++) {
+            prev_on[n] += chunk_prev_on[c][n];
         }
-        
     }
     
-    for (int i=0; i<this->nbasins * this->N; i++) {
-        if (basin_trans_den[i][0] > 0) {
-            basin_trans[i][0] = basin_trans_num[i][0] / basin_trans_den[i][0];
-            // basin_trans[i][1] = 1 - basin_trans[i][0];
-            basin_trans[i][1] = basin_trans_num[i][1] / basin_trans_den[i][0];
-        } else {
-            basin_trans[i][0] = 0.5;
-            basin_trans[i][1] = 0.5;
-        }
-        if (basin_trans_den[i][1] > 0) {
-            basin_trans[i][2] = basin_trans_num[i][2] / basin_trans_den[i][1];
-            basin_trans[i][3] = basin_trans_num[i][3] / basin_trans_den[i][1];
-        } else {
-            basin_trans[i][2] = 0.5;
-            basin_trans[i][3] = 0.5;
-   
+    for (int a=0; a<K; a++) {
+        for (int n=0; n<N; n++) {
+            double* s = &stats[4*(N*a + n)];
+            double den_on = s[2] + s[3];
+            // Neurons spiking in every earlier bin have no silent history at all
+            double den_off = (prev_on[n] < nbins) ? max(total[a] - den_on, 0.0) : 0;
+            s[0] = max(den_off - s[1], 0.0);
+            double* this_trans = &basin_trans[4*(N*a + n)];
+            if (den_off > 0) {
+                this_trans[0] = s[0] / den_off;
+                this_trans[1] = s[1] / den_off;
+            } else {
+                this_trans[0] = 0.5;
+                this_trans[1] = 0.5;
+            }
+            if (den_on > 0) {
+                this_trans[2] = s[2] / den_on;
+                this_trans[3] = s[3] / den_on;
+            } else {
+                this_trans[2] = 0.5;
+                this_trans[3] = 0.5;
+            }
         }
-        // basin_trans[i][3] = 1 - basin_trans[i][2];
     }
+    update_self_trans();
+    return;
+}
 
-    
+template <class BasinT>
+void Autocorr<BasinT>::update_basin_trans_indep() {
+    // Staying posterior with basins drawn independently from w in every bin:
+    // the diagonal of the joint w[n] P_{t-1}[n] w[m] P_t[m], whose normaliser
+    // factorises into the two marginal sums
+    int K = this->nbasins;
+    update_basin_trans([&](int t, double* P_diag) {
+        double norm_prev = 0;
+        double norm_this = 0;
+        for (int n=0; n<K; n++) {
+            norm_prev += this->state_list[t-1]->P[n] * this->w[n];
+            norm_this += this->state_list[t]->P[n] * this->w[n];
+        }
+        for (int i=0; i<K; i++) {
+            P_diag[i] = (this->state_list[t]->P[i] * this->w[i]) * (this->state_list[t-1]->P[i] * this->w[i]) / (norm_prev * norm_this);
+        }
+    });
     return;
 }
 
@@ -2150,100 +4628,53 @@ void Autocorr<BasinT>::update_basin_trans_indep() {
 template <class BasinT>
 void Autocorr<BasinT>::update_P() {
     
+    // The joint P(t-1 in j, t in i) ~ forward[t-1,j] trans_t[j,i] backward[t,i]
+    // is only needed through its off-diagonal column sums (switch_P, the
+    // switches into i, which weight the words of basin i) and its diagonal
+    // (P_diag, staying in i, for basin_trans); with the rank-one-plus-diagonal
+    // trans_t both take O(K) per bin
+    int K = this->nbasins;
+    vector<double> switch_P ((long) this->T * K, 0);
+    update_basin_trans([&](int t, double* P_diag) {
+        double* this_P = &switch_P[(long) t*K];
+        const double* fw_prev = &this->forward[(t-1)*K];
+        const double* bw_this = &this->backward[t*K];
+        const double* self = &self_table[t*K];
+        const vector<double>& P = this->state_list[t]->P;
+        
+        // this_P holds the off-diagonal sums of forward[t-1] until it is overwritten
+        sums_excluding(fw_prev, K, this_P);
+        double norm = 0;
+        for (int i=0; i<K; i++) {
+            this_P[i] = bw_this[i] * this->w[i] * P[i] * this_P[i];
+            P_diag[i] = bw_this[i] * this->w[i] * self[i] * fw_prev[i];
+            norm += this_P[i] + P_diag[i];
+        }
+        for (int i=0; i<K; i++) {
+            this_P[i] /= norm;
+            P_diag[i] /= norm;
+        }
+    });
+    
     for (state_iter it=this->train_states.begin(); it != this->train_states.end(); ++it) {
         State& this_state = it->second;
         this_state.weight.assign(this->nbasins,0);
     }
-    
-    vector<vector<double> > basin_trans_num (this->nbasins * this->N, vector<double> (4,0));
-    vector<vector<double> > basin_trans_den (this->nbasins * this->N, vector<double> (2,0));
-    vector<double> denom  (this->nbasins,0);
-    
+    vector<double> denom (K, 0);
     for (int t=1; t<this->T; t++) {
-        //        State& this_state = this->train_states.at(words[t]);
         State& this_state = *(this->state_list[t]);
-        
-        vector<double> this_P  (this->nbasins,0);
-        vector<double> this_trans = trans_at_t(t);
-
-        vector<double> P_joint(this->nbasins * this->nbasins, 0);
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            for (int m=0; m<this->nbasins; m++) {
-                P_joint[n*this->nbasins+m] = this->backward[t*this->nbasins + m] * this_trans[n*this->nbasins + m] * this->forward[(t-1)*this->nbasins + n];
-                norm += P_joint[n*this->nbasins + m];
-            }
-        }
-        for (int n=0; n<this->nbasins*this->nbasins; n++) {
-            P_joint[n] /= norm;
-        }
-        
-
-        for (int i=0; i<this->nbasins; i++) {
-            for (int j=0; j<this->nbasins; j++) {
-                if (j != i) {
-                    this_P[i] += P_joint[j*this->nbasins + i];
-                }
-            }
-        }
-        
-        for (int i=0; i<this->nbasins; i++) {
-            
-            double delta_denom = this_P[i] - denom[i];
-
-            this_state.weight[i] += this_P[i];
-
-            denom[i] += (delta_denom / (t+1));
-            
-            for (int n=0; n<this->N; n++) {
-                char sp_prev = (this->state_list[t-1]->word)[n];
-                char sp_this = this_state.word[n];
-                
-                for (int a=0; a<4; a++) {
-                    double delta_num = -basin_trans_num[this->N*i+n][a];
-                    delta_num += (a == (sp_this + 2*sp_prev)) ? P_joint[i*this->nbasins+i] : 0;
-                    basin_trans_num[this->N*i + n][a] += delta_num / (t+1);
-                }
-                
-                for (int a=0; a<2; a++) {
-                    double delta_den = -basin_trans_den[this->N*i+n][a];
-                    delta_den += (a == sp_prev) ? P_joint[i*this->nbasins+i] : 0;
-                    basin_trans_den[this->N*i + n][a] += delta_den / (t+1);
-                }
-//                basin_trans_num[this->N*i + n][sp_this + 2*sp_prev] += P_joint[i*this->nbasins+i];
-//                basin_trans_den[this->N*i + n][sp_prev] += P_joint[i*this->nbasins+i];
-            }
-        }
-    }
-    
-    for (int i=0; i<this->nbasins * this->N; i++) {
-        if (basin_trans_den[i][0] > 0) {
-            basin_trans[i][0] = basin_trans_num[i][0] / basin_trans_den[i][0];
-            // basin_trans[i][1] = 1 - basin_trans[i][0];
-            basin_trans[i][1] = basin_trans_num[i][1] / basin_trans_den[i][0];
-        } else {
-            basin_trans[i][0] = 0.5;
-            basin_trans[i][1] = 0.5;
-        }
-        if (basin_trans_den[i][1] > 0) {
-            basin_trans[i][2] = basin_trans_num[i][2] / basin_trans_den[i][1];
-            basin_trans[i][3] = basin_trans_num[i][3] / basin_trans_den[i][1];
-        } else {
-            basin_trans[i][2] = 0.5;
-            basin_trans[i][3] = 0.5;
-            
+        for (int i=0; i<K; i++) {
+            this_state.weight[i] += switch_P[(long) t*K + i];
+            denom[i] += switch_P[(long) t*K + i];
         }
-        // basin_trans[i][3] = 1 - basin_trans[i][2];
     }
-    
     for (state_iter it=this->train_states.begin(); it != this->train_states.end(); ++it) {
         State& this_state = it->second;
         for (int i=0; i<this->nbasins; i++) {
-            this_state.weight[i] /= (this->T * denom[i]);
-            //            this_state.weight[i] /= (denom[i]);
-            this_state.P[i] = this->basins[i].P_state(this_state);
+            this_state.weight[i] /= denom[i];
         }
     }
+    this->update_emiss(this->train_states);
     
     return;
 }
@@ -2270,46 +4701,88 @@ void Autocorr<BasinT>::update_w() {
 
 
 template <class BasinT>
-vector<double> Autocorr<BasinT>::trans_at_t(int t) {
-    vector<double> trans (this->nbasins * this->nbasins, 0);
+void Autocorr<BasinT>::update_self_trans() {
+    // The self-transition factor of basin a between bins t-1 and t is
+    //    prod_n basin_trans[a,n][code_n] = self_silent[a] * prod_{n on at t-1 or t} self_ratio[a,n,code_n]
+    // with self_silent[a] = prod_n basin_trans[a,n][0], so only the active
+    // neurons of the two words need visiting.
+    self_silent.assign(this->nbasins, 1);
+    self_ratio.assign(4 * this->nbasins * this->N, 1);
+    self_exact.assign(this->nbasins, 0);
     for (int a=0; a<this->nbasins; a++) {
-        for (int b=0; b<this->nbasins; b++) {
-            trans[this->nbasins*a + b] = this->w[b];
-            if (a==b) {
-                for (int n=0; n<this->N; n++) {
-                    char sp_prev = this->state_list[t-1]->word[n];
-                    char sp_this = this->state_list[t]->word[n];
-                    trans[this->nbasins*a + b] *= basin_trans[this->N*a + n][sp_this + 2*sp_prev];
+        for (int n=0; n<this->N; n++) {
+            const double* this_trans = &basin_trans[4*(this->N*a + n)];
+            self_silent[a] *= this_trans[0];
+            if (this_trans[0] > 0) {
+                for (int c=1; c<4; c++) {
+                    self_ratio[4*(this->N*a + n) + c] = this_trans[c] / this_trans[0];
                 }
             } else {
-                trans[this->nbasins*a + b] *= this->state_list[t]->P[b];
+                // Ratio form undefined; self_trans() takes the full product for this basin
+                self_exact[a] = 1;
             }
         }
     }
-    return trans;
+    // Tabulate self_t for every bin once, for the recursions of this iteration
+    int K = this->nbasins;
+    self_table.assign((long) this->T * K, 1);
+    int nblocks = (this->T + self_block - 1) / self_block;
+    parallel_for(nblocks, max(this->time_threads, 1), [&](int b) {
+        int t1 = min((b+1) * self_block, this->T);
+        for (int t=max(b * self_block, 1); t<t1; t++) {
+            (this->*self_trans_kernel)(t, &self_table[(long) t*K]);
+        }
+    });
+    return;
+}
+
+template <class BasinT>
+template <int W>
+void Autocorr<BasinT>::self_trans(int t, double* out) {
+    const State* prev = this->state_list[t-1];
+    const State* curr = this->state_list[t];
+    int nlanes = curr->bits.size();
+    for (int a=0; a<this->nbasins; a++) {
+        double P = 1;
+        if (self_exact[a]) {
+            for (int n=0; n<this->N; n++) {
+                P *= basin_trans[4*(this->N*a + n) + curr->word[n] + 2*prev->word[n]];
+            }
+        } else {
+            const double* ratio = &self_ratio[4*this->N*a];
+            P = self_silent[a];
+            for_each_flip<W>(prev->bits.data(), curr->bits.data(), nlanes, [&](int n, int code) {
+                P *= ratio[4*n + code];
+            });
+        }
+        out[a] = P;
+    }
+    return;
 }
 
 template <class BasinT>
 void Autocorr<BasinT>::update_forward() {
-    for (int n=0; n<this->nbasins; n++) {
+    // forward[t,n] = sum_m trans_t[m,n] forward[t-1,m]
+    //              = w[n] (P_t[n] sum_{m != n} forward[t-1,m] + self_t[n] forward[t-1,n])
+    int K = this->nbasins;
+    for (int n=0; n<K; n++) {
         this->forward[n] = this->w[n] * (this->state_list[0]->P)[n];
     }
+    vector<double> off (K);
     for (int t=1; t<this->T; t++) {
         //        State& this_state = this->train_states.at(words[t-1]);
-        vector<double> this_trans = trans_at_t(t);
-        double norm = 0;
-        for (int n=0; n<this->nbasins; n++) {
-            this->forward[this->nbasins*t + n] = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                this->forward[this->nbasins*t + n] += this_trans[m*this->nbasins+n] * this->forward[(t-1)*this->nbasins + m];
-            }
-            norm += this->forward[this->nbasins*t + n];
+        const double* prev = &this->forward[(t-1)*K];
+        double* curr = &this->forward[t*K];
+        const double* P = (this->state_list[t]->P).data();
+        const double* self = &self_table[t*K];
+        sums_excluding(prev, K, off.data());
+        for (int n=0; n<K; n++) {
+            curr[n] = this->w[n] * (P[n] * off[n] + self[n] * prev[n]);
         }
-        for (int n=0; n<this->nbasins; n++) {
-            this->forward[this->nbasins*t+n] /= norm;
-        }
-        
+        normalize_probs(curr, K);
     }
+    // Current for this model: get_forward() must not redo the HMM recursion
+    this->fb_stale = false;
     return;
 
     
@@ -2324,26 +4797,27 @@ void Autocorr<BasinT>::update_backward() {
         this->backward[tmax*this->nbasins+n] = 1;
     }
     
+    // backward[t,n] = sum_m trans_{t+1}[n,m] backward[t+1,m]
+    //               = sum_{m != n} w[m] P_{t+1}[m] backward[t+1,m] + w[n] self_{t+1}[n] backward[t+1,n]
+    int K = this->nbasins;
+    vector<double> scored (K);
+    vector<double> off (K);
     for (int t=tmax-1; t>=0; t--) {
         //        State& this_state = this->train_states[words[t]];
-        double norm = 0;
-        vector<double> this_trans = trans_at_t(t+1);
-        
-        for (int n=0; n<this->nbasins; n++) {
-            //            forward[t*this->nbasins + n] = this_state.P[n];
-            this->backward[t*this->nbasins + n] = 0;
-            
-            for (int m=0; m<this->nbasins; m++) {
-                this->backward[t*this->nbasins + n] += this_trans[n*this->nbasins + m] * this->backward[(t+1)*this->nbasins + m];
-            }
-            norm += this->backward[t*this->nbasins + n];
+        const double* next = &this->backward[(t+1)*K];
+        double* curr = &this->backward[t*K];
+        const double* P = (this->state_list[t+1]->P).data();
+        const double* self = &self_table[(t+1)*K];
+        for (int m=0; m<K; m++) {
+            scored[m] = this->w[m] * P[m] * next[m];
         }
-        
-        for (int n=0; n<this->nbasins; n++) {
-            this->backward[t*this->nbasins + n] /= norm;
+        sums_excluding(scored.data(), K, off.data());
+        for (int n=0; n<K; n++) {
+            curr[n] = off[n] + this->w[n] * self[n] * next[n];
         }
-        
+        normalize_probs(curr, K);
     }
+    this->fb_stale = false;
     return;
 }
 
@@ -2377,7 +4851,13 @@ vector<double> Autocorr<BasinT>::train(int niter) {
     int uncorr_iter = 20;
     uncorr_iter = (uncorr_iter < niter) ? uncorr_iter : niter;
 //    vector<double> train_logli_begin = this->EMBasins<BasinT>::train(uncorr_iter);
-    vector<double> train_logli_begin = this->HMM<BasinT>::train(uncorr_iter);
+    vector<double> train_logli_begin = get<0>(this->HMM<BasinT>::train(uncorr_iter));
+    if (this->stop_requested()) {
+        return train_logli_begin;
+    }
+    // HMM::train leaves the mixture weights unset; start them from the stationary
+    // distribution of the uncorrelated fit
+    this->w = this->stationary_prob();
 //    for (int i=0; i<this->nbasins * this->N; i++) {
 //     //        basin_trans[i][0] = 0.1*((double) rand() / (double) RAND_MAX) + 0.45;
 //         basin_trans[i][0] = 0.5;
@@ -2401,20 +4881,21 @@ vector<double> Autocorr<BasinT>::train(int niter) {
         train_logli[i] = train_logli_begin[i];
     }
     for (int i=uncorr_iter; i<niter; i++) {
+        if (this->stop_requested()) {
+            cout << "Stopped before iteration " << i << endl;
+            train_logli.resize(i);
+            break;
+        }
         cout << "Iteration " << i << endl;
         
         // E step
         
+        // Basin-major order, so that only one double-precision accumulator is alive at a time
         for (int j=0; j<this->nbasins; j++) {
             this->basins[j].reset_stats();
-        }
-        
-        for (state_iter it = this->train_states.begin(); it!=this->train_states.end(); ++it) {
-            for (int j=0; j<this->nbasins; j++) {
+            for (state_iter it = this->train_states.begin(); it!=this->train_states.end(); ++it) {
                 this->basins[j].increment_stats(it->second);
             }
-        }
-        for (int j=0; j<this->nbasins; j++) {
             this->basins[j].normalize_stats();
         }
         
@@ -2430,6 +4911,7 @@ vector<double> Autocorr<BasinT>::train(int niter) {
             
             this->basins[j].doMLE(alpha);
         }
+        this->model_version++;
 
         cout << "Forward..." << endl;
         update_forward();
@@ -2451,51 +4933,46 @@ vector<double> Autocorr<BasinT>::train(int niter) {
 
 template <class BasinT>
 vector<int> Autocorr<BasinT>::viterbi() {
-    
-    vector<int> alpha_max (this->T,0);
-    vector<int> argmax (this->T*this->nbasins, 0);
-    
-    vector<double> max (this->nbasins, 1);
-    for (int t=(this->T-1); t>0; t--) {
-        double norm = 0;
-        vector<double> this_trans = trans_at_t(t);
-        for (int n=0; n<this->nbasins; n++) {
-            double this_max = 0;
-            int this_arg = 0;
-            for (int m=0; m<this->nbasins; m++) {
-                double tmp = this_trans[n*this->nbasins+m] * max[m];
-                
-                if (tmp > this_max) {
-                    this_max = tmp;
-                    this_arg = m;
-                }
+    // trans_t is w[b] P_t[b] off the diagonal and w[a] self_t[a] on it, so
+    // each step of the max-product only needs the two largest off-diagonal
+    // scores: O(K) per bin instead of O(K^2)
+    int K = this->nbasins;
+    vector<double> log_w (K);
+    for (int k=0; k<K; k++) {
+        log_w[k] = log(this->w[k]);
+    }
+    vector<double> scored (K);
+    vector<double> log_start (K);
+    for (int k=0; k<K; k++) {
+        log_start[k] = log_w[k] + log((this->state_list[0]->P)[k]);
+    }
+    return this->viterbi_path(this->T, this->checkpoints, log_start.data(), [&](int t, const double* v_next, double* v, int* arg) {
+        const double* self = &self_table[t*K];
+        const vector<double>& P = this->state_list[t]->P;
+        int best = 0;
+        int second = -1;
+        for (int b=0; b<K; b++) {
+            scored[b] = log_w[b] + log(P[b]) + v_next[b];
+            if (b > 0 && scored[b] > scored[best]) {
+                second = best;
+                best = b;
+            } else if (b > 0 && (second < 0 || scored[b] > scored[second])) {
+                second = b;
             }
-            max[n] = this_max;
-            norm += this_max;
-            argmax[t*this->nbasins + n] = this_arg;
-        }
-        for (int n=0; n<this->nbasins; n++) {
-            max[n] /= norm;
         }
-    }
-    //    State& this_state = this->train_states.at(words[0]);
-    double this_max = 0;
-    int this_arg = 0;
-    for (int m=0; m<this->nbasins; m++) {
-        double tmp = this->w[m] * (this->state_list[0]->P)[m] * max[m];
-        if (tmp > this_max) {
-            this_max = tmp;
-            this_arg = m;
+        for (int a=0; a<K; a++) {
+            int off = (a != best) ? best : second;
+            double diag = log_w[a] + log(self[a]) + v_next[a];
+            if (off >= 0 && scored[off] > diag) {
+                v[a] = scored[off];
+                arg[a] = off;
+            } else {
+                v[a] = diag;
+                arg[a] = a;
+            }
         }
-    }
-    alpha_max[0] = this_arg;
-    for (int t=1; t<this->T; t++) {
-        alpha_max[t] = argmax[t*this->nbasins + alpha_max[t-1]];
-    }
-    
-    return alpha_max;
+    });
 }
-
 template <class BasinT>
 double Autocorr<BasinT>::logli() {
     
@@ -2508,8 +4985,10 @@ double Autocorr<BasinT>::logli() {
     
     for (int t=1; t<this->T; t++) {
         //        State& this_state = this->train_states.at(words[t]);
-        vector<double> this_trans = trans_at_t(t);
-        double delta = log(this_trans[alpha[t-1]*this->nbasins + alpha[t]]) - logli;
+        int a = alpha[t-1];
+        int b = alpha[t];
+        double this_trans = this->w[b] * ((a == b) ? self_table[t*this->nbasins + a] : (this->state_list[t]->P)[b]);
+        double delta = log(this_trans) - logli;
         
         logli += delta / t;
     }
@@ -2518,14 +4997,17 @@ double Autocorr<BasinT>::logli() {
 
 template <class BasinT>
 vector<double> Autocorr<BasinT>::get_basin_trans() {
-    
-    vector<double> basin_trans_out (4 * this->nbasins * this->N);
-    for (int n=0; n<this->N; n++) {
-        for (int a=0; a<this->nbasins; a++) {
-            for (int i=0; i<4; i++) {
-                basin_trans_out[4*this->N*a + 4*n + i] = basin_trans[this->N*a + n][i];
-            }
-        }
-    }
-    return basin_trans_out;
+    // Already laid out as [basin][neuron][code]
+    return basin_trans;
 }
+
+// The basin model is chosen at run time, so every (temporal model, basin model)
+// combination is compiled here once.
+template class EMBasins<TreeBasin>;
+template class EMBasins<IndependentBasin>;
+template class HMM<TreeBasin>;
+template class HMM<IndependentBasin>;
+template class HMMStream<TreeBasin>;
+template class HMMStream<IndependentBasin>;
+template class Autocorr<TreeBasin>;
+template class Autocorr<IndependentBasin>;
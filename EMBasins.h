@@ -13,10 +13,14 @@
 
 #include <gsl/gsl_rng.h>
 
+#include "Word.h"
+#include "WordCache.h"
+
 #include <vector>
 #include <string>
 #include <map>
 #include <tuple>
+#include <atomic>
 
 using namespace std;
 
@@ -26,12 +30,30 @@ class RNG
 {
 public:
     RNG();
+    RNG(unsigned long seed, unsigned long stream);    // Independent stream derived from (seed, stream)
     ~RNG();
     int discrete(const vector<double>&);
     bool bernoulli(double);
+    double uniform();
+    unsigned long get();
     vector<int> randperm(int);
 private:
     gsl_rng* rng_pr;
+    RNG(const RNG&);
+    RNG& operator=(const RNG&);
+};
+
+// ************ AliasTable ***************
+// Walker/Vose alias table: O(1) draws from a fixed discrete distribution
+class AliasTable
+{
+public:
+    AliasTable() {};
+    AliasTable(const double* p, int n);
+    int draw(RNG&) const;
+private:
+    vector<double> prob;
+    vector<int> alias;
 };
 
 struct State
@@ -44,12 +66,15 @@ struct State
     double pred_prob;
 
     vector<char> word;
+    vector<word_lane> bits;         // word packed into 64-bit lanes, see Word.h
     
     int identifier;
 };
 // *********************************
-typedef map<string,State>::iterator state_iter;
-typedef map<string,State>::const_iterator const_state_iter;
+// States are keyed by their packed words (Word.h)
+typedef map<word_key,State,WordLess> state_map;
+typedef state_map::iterator state_iter;
+typedef state_map::const_iterator const_state_iter;
 
 // ************ Spike ***************
 struct Spike
@@ -58,6 +83,25 @@ struct Spike
     int neuron_ind;
 };
 // *********************************
+// ************ ObsRun ***************
+// Stretch of consecutive bins with the same observation (same State, or all unobserved)
+struct ObsRun
+{
+    int start;
+    int len;
+};
+// Posterior sums over the skipped runs, grouped by (state, run length)
+typedef map<pair<State*, int>, vector<double> > run_group_map;
+// *********************************
+// ************ HMMScore ***************
+// A recording scored by a trained HMM, see HMM::score()
+struct HMMScore
+{
+    double logli;           // log P(recording)
+    vector<int> path;       // Viterbi basin sequence
+    vector<double> P;       // T x nbasins posteriors (empty unless requested)
+};
+// *********************************
 // ************ SpikeComparison ***************
 class SpikeComparison
 {
@@ -96,49 +140,74 @@ public:
     vector<double> P_test() const;    
     vector<paramsStruct> basin_params();
     vector<char> sample(int);
+    vector<char> sample(int nsamples, unsigned long seed, int nthreads);
     vector<char> word_list();
     vector<char> word_list_test();
+    void set_posterior_cache(size_t n) {word_cache.set_capacity(n);};     // Words whose posterior test() keeps (0: none)
+    const WordCache& posterior_cache() const {return word_cache;};
+    void set_stop_flag(const atomic<bool>* flag) {stop_flag = flag;};      // train() ends early, after the current iteration, once *flag is set
+    bool stop_requested() const {return stop_flag && stop_flag->load();};
     
     vector<double> w;       // 1 x nbasins
     vector<double> m;       // N x nbasins
     
     vector<double> test_logli;
+    vector<int> test_mode;  // MAP mode of every bin scored by the last test()
     
 protected:
     int nbasins;
     int N;
+    int word_width;         // Lane count of the packed-word kernels for this N (0: generic)
     double nsamples;
     
-    map<string, State> all_states;
-    map<string, State> train_states;
-    map<string, State> test_states;
+    state_map all_states;
+    state_map train_states;
+    state_map test_states;
     
     vector<BasinT> basins;
     
     RNG* rng;
     
-    vector<string> raster;
+    vector<word_lane> raster;       // Packed word of every bin, word_nlanes(N) lanes each
     
     void update_w();
     double update_P();
     double update_P_test();
     
+    static const int sample_block = 4096;     // Samples per independent RNG stream
+    void sample_words(const int*, int, char*, RNG&);
     double set_state_P(State&);
+    double normalize_state_P(State&);
+    
+    // Posteriors of words seen by test(), valid while model_version and w are unchanged
+    WordCache word_cache;
+    unsigned long model_version;    // Bumped whenever the basins are refitted
+    const atomic<bool>* stop_flag;  // Owned by the caller, see set_stop_flag()
+    int cached_state_P(State&);     // Returns the MAP mode
+    double test_states_logli();
+    void update_emiss(state_map&);
+    void pack_states(state_map&);
     vector<Spike> sort_spikes(const vector<vector<double> >&, double) const;
     
 };
 
 // *********************************
 
+template <class BasinT> class HMMStream;
+
 // ************ HMM ***************
 template <class BasinT>
 class HMM : public EMBasins<BasinT>
 {
 public:
     HMM(vector<vector<double> >& st, vector<double>, vector<double>, double binsize, int nbasins);
+    HMM(vector<vector<vector<double> > >& trials, double trial_duration, double binsize, int nbasins);
     
     tuple<vector<double>,vector<double>> train(int niter);
+    tuple<vector<double>,vector<double>> resume_train(int niter);     // More EM iterations from the current parameters
     vector<int> viterbi(bool); 
+    vector<HMMScore> score(const vector<vector<vector<double> > >& recordings, const vector<double>& durations, double binsize, bool posteriors=false, int nthreads=0);
+    HMMStream<BasinT> stream(double binsize, int lag=0) const;
     
 //    vector<char> get_raster();
     vector<double> emiss_prob();
@@ -147,47 +216,207 @@ public:
     vector<double> get_P();
     vector<double> get_trans();
     vector<double> stationary_prob();
+    double spectral_gap();              // 1 - |lambda_2| of trans
+    long mixing_time(double eps=0.25);  // Steps until every start is within eps (TV) of stationary_prob(); -1: never
     pair<vector<double>, vector<double> > pred_prob();
     vector<int> state_v_time();
     
     vector<char> sample(int);
+    vector<char> sample(int nsamples, unsigned long seed, int nthreads, int nchains=1);
     vector<double> P_indep();
+    
+    void set_min_skip_run(int);     // Shortest run of identical bins stepped in closed form (0: never)
+    void set_time_threads(int);     // Threads for the parallel-in-time recursions (0 or 1: sequential)
+    void set_checkpoints(int);      // Bins between stored forward checkpoints (0: store every bin, -1: sqrt(T))
+    void set_sparse_trans(int top, double min_prob=0);     // Keep at most top entries per row of trans, none below min_prob (0, 0: dense)
+    void set_beam(double rel_threshold, int max_modes=0);   // Per-bin beam over the modes (0, 0: off), see beam_prune()
+    double beam_discarded() const {return beam_lost;};      // Mass dropped by the beam over the bins of the last E-step
+    int ntrials() const {return trial_starts.size() - 1;};
 protected:
     int T, tmax, tskip;
+    
+    // Independent trials laid end to end on [0,T): each starts afresh from w0,
+    // and no transition links the last bin of a trial to the next one
+    vector<int> trial_starts;       // First bin of each trial, then T
+    vector<char> new_trial;         // new_trial[t]: a trial starts at t (t = 0..T)
+    void build_bins(const vector<Spike>& all_spikes, const vector<double>& unobserved_l, const vector<double>& unobserved_u);
 
    
     vector<double> forward;         // Forward filtering distribution
     vector<double> backward;        // Backward filtering distribution
+    bool fb_stale;                  // forward/backward predate the current trans and emissions
     //vector<string> words;
 
     vector<State*> state_list;
+    vector<double> unit_emiss;      // Emission vector of unobserved bins (all ones)
+    state_map heldout_states;           // Distinct words of the unobserved bins, for scoring them
+    vector<State*> heldout_list;        // Held-out state of each bin (NULL if observed)
+    const double* emiss_at(int t) const;
     
     void update_forward();
     void update_backward();
 
+    void init_params();
     void forward_backward();
+    void refresh_forward_backward();
     vector<double> trans_at_t(int);
-    
-    void update_P();
+    pair<double, double> em_update(bool with_trans);
+    void add_estep_stats(int t0, int t1, double* fw, double* bw, const double* prev_bw, vector<double>* flow, vector<double>& denom, double* logli);
+    double joint_logli();
+    void finish_P(vector<double>& denom);
 
-    double logli(bool);
+    
+    // Closed-form stepping through runs of identical observations, see update_run_stats()
+    int min_skip_run;
+    vector<ObsRun> runs;                                    // Runs skipped by the recursions
+    map<State*, vector<vector<double> > > run_powers;       // (M/rho)^(2^j), M = diag(e) trans
+    map<State*, double> run_log_rho;                        // log rho of each state's M
+    vector<double> run_log_step;                            // Log normaliser of each run's backward jump
+    vector<double> run_trans;                               // Expected transitions inside the runs
+    map<State*, vector<double> > run_occupancy;             // Summed posteriors over the runs of each state
+    bool runs_filled;                                       // forward/backward valid inside the runs
+    
+    void find_runs();
+    void update_run_powers();
+    void run_power_apply(State*, int n, bool transpose, const double* x, double* y);
+    vector<double> run_sum(State*, int n, const vector<double>& Y, vector<double>& power);
+    void update_run_stats();
+    void add_run_groups(int t0, int t1, const double* fw, const double* bw, const double* next_fw, run_group_map& groups);
+    void finish_run_stats(run_group_map& groups);
+    void fill_runs();
+    void fill_run(const ObsRun&, double* fw, double* bw);
+    
+    // Parallel-in-time recursions, see update_chunk_transfer()
+    int time_threads;
+    vector<int> time_chunks;                    // Chunk boundaries, never inside a skipped run
+    vector<vector<double> > chunk_transfer;     // Normalised transfer matrix of each chunk
+    
+    void update_chunk_transfer();
+    void forward_range(int t0, int t1, double* fw);
+    void backward_range(int t0, int t1, double* bw);
+    
+    // Checkpointed (low-memory) forward-backward, see sweep_segments()
+    int checkpoint_interval;
+    vector<int> checkpoints;                    // Segment boundaries; empty when forward/backward are stored in full
+    
+    vector<int> segment_bounds(int nseg, bool at_trials=false);
+    void find_segments();
+    template <class F> void sweep_segments(F visit);
+    vector<double> checkpointed_output(int which);
+    
+    // Adaptive beam over the modes, see beam_prune()
+    double beam_rel;                // Keep the modes with at least beam_rel times the largest mass...
+    int beam_width;                 // ...and at most beam_width of them (0: no limit)
+    double beam_lost;
+    
+    bool beam_active() const;
+    double beam_prune(double* p, vector<double>& scratch);
+    
+    // Log-space Viterbi, see viterbi_scan()
+    template <class Step> vector<int> viterbi_path(int nbins, const vector<int>& segments, const double* log_start, Step step);
+    template <class Index, class Step> vector<int> viterbi_scan(int nbins, const vector<int>& segments, const double* log_start, Step step);
 private:
     vector<double> w0;
     vector<double> trans;           // State transition probability matrix
     
-    void update_trans();
-    vector<double> emiss_obs(bool,int);
+    void finish_trans(vector<double>& flow, const vector<double>& start_post);
+    
+    // Sparse transitions, see prune_trans()
+    int sparse_top;
+    double sparse_min;
+    vector<int> trans_row;          // CSR row offsets into trans_col/trans_val; empty while trans is dense
+    vector<int> trans_col;
+    vector<double> trans_val;
+    
+    void prune_trans();
+    void trans_apply(bool transpose, const double* x, double* y, bool sparse_x=false) const;
+    vector<double> log_trans_values() const;
+    void trans_max_plus(const double* log_vals, const double* w, double* v, int* arg) const;
+    const double* emiss_obs(bool,int) const;
+    
+    // Long-run summaries of trans (Markov.h), cached until trans or w0 change
+    vector<double> markov_trans;    // trans and w0 the cached values belong to
+    vector<double> markov_w0;
+    vector<double> markov_pi;       // empty: not computed yet
+    double markov_lambda2;          // < 0: not computed yet
+    double markov_eps;              // eps of the cached mixing time (< 0: none)
+    long markov_tmix;
+    
+    void markov_refresh();
 
 };
 // *********************************
 
+// ************ HMMStream ***********
+// Online decoding with a trained HMM, one bin at a time (see HMM::stream()).
+// Each closed bin updates the filtered posterior P(mode_t | bins 0..t). With
+// lag > 0, smoothed posteriors also come out in blocks of lag bins, each from
+// at least lag and at most 2*lag-1 later bins. One call can close many bins
+// (a gap in the spikes), so the posteriors of every bin it closed or smoothed
+// are kept until the next call that closes or smooths any. Buffers are
+// allocated up front: a bin costs the K emission probabilities plus O(K^2)
+// (amortised over a block for smoothing), with no allocation unless one call
+// closes more than 2*lag bins.
+template <class BasinT>
+class HMMStream
+{
+public:
+    HMMStream(int N, const vector<BasinT>& basins, const vector<double>& trans, const vector<double>& w0, double binsize, int lag=0);
+    
+    void push_spike(double time, int neuron);   // Spikes in time order (same units as binsize); closes the bins before its own
+    void advance(double time);                  // Closes the bins ending at or before time
+    void push_word(const char* word);           // Closes one bin with this word of N 0/1 entries (not mixed with push_spike)
+    void finish();                              // Smooths the bins left, with the later bins there are
+    void reset();                               // New recording, starting from w0
+    
+    int nbins() const {return t;};
+    const double* filtered() const {return filt.data();};  // P(mode | bins so far) of the last closed bin, K entries
+    int filtered_begin() const {return filt_begin;};       // Bins the latest call closing any closed: [filtered_begin, nbins())...
+    const double* filtered(int bin) const;                  // ...and their filtered posteriors, NULL for bins outside
+    double logli() const {return log_li;};                  // log P(bins so far)
+    int smoothed_begin() const {return smooth_begin;};     // Bins the latest call smoothing any smoothed: [smoothed_begin, smoothed_end)...
+    int smoothed_end() const {return smooth_end;};
+    const double* smoothed(int bin) const;                  // ...and their posteriors, NULL for bins outside
+    int late_spikes() const {return nlate;};                // Spikes dropped for falling in an already closed bin
+private:
+    int N, K, lag;
+    int nring;                      // Bins kept for smoothing, 2*lag
+    double binsize;
+    vector<BasinT> basins;
+    vector<double> trans;
+    vector<double> w0;
+    
+    int t;                          // Bins closed so far; bin t is open
+    double log_li;
+    State open_state;               // Word of the open bin, filled in place
+    vector<double> pred;
+    vector<double> filt;
+    int nlate;
+    
+    vector<double> emiss_ring;      // Emission and filtered probabilities of the last nring bins
+    vector<double> filt_ring;
+    vector<double> back;
+    vector<double> back_next;
+    
+    bool call_closed, call_smoothed;    // Whether the current call has closed / smoothed a bin yet
+    int filt_begin;
+    vector<double> filt_out;        // Filtered posteriors of bins [filt_begin, t)
+    int smooth_begin, smooth_end;
+    vector<double> smooth_out;      // Smoothed posteriors of bins [smooth_begin, smooth_end)
+    
+    void begin_call();
+    
+    void close_bin();
+    void smooth_to(int end);
+};
+// *********************************
+
 // ************ Autocorr ***********
 template <class BasinT>
 class Autocorr : public HMM<BasinT>
 {
 public:
     Autocorr(vector<vector<double> >& st, double binsize, int nbasins);
-    ~Autocorr();
     
     vector<double> train(int niter);
     vector<int> viterbi();
@@ -200,11 +429,22 @@ private:
     void update_P();
     void update_w();
     void update_basin_trans_indep();
+    template <class F> void update_basin_trans(F stay);
     
-    vector<double> trans_at_t(int);
-    
-    vector<double*> basin_trans;
+    // The transition matrix into bin t is rank one plus diagonal,
+    //    trans_t[a,b] = w[b] P_t[b]  (a != b),   w[a] self_t[a]  (a == b),
+    // so the recursions below never form it and cost O(K) per bin
+    vector<double> basin_trans;    // K x N x 4: basin_trans[4*(N*a + n) + c], c = spike_now + 2*spike_before
     double logli();
+    
+    // Self-transition factors prod_n basin_trans[a,n][code_n], see update_self_trans()
+    vector<double> self_silent;
+    vector<double> self_ratio;
+    vector<char> self_exact;
+    vector<double> self_table;     // T x K, row t = self_t (row 0 unused), refreshed by update_self_trans()
+    void update_self_trans();
+    template <int W> void self_trans(int t, double* out);
+    void (Autocorr::*self_trans_kernel)(int, double*);      // self_trans<W> for this N, set at construction
 };
 
 
@@ -0,0 +1,178 @@
+//--------------------------------------------
+//  Markov.h
+//
+//  Long-run summaries of a K-state transition
+//  matrix (row-major, rows summing to one):
+//  stationary distribution, second eigenvalue
+//  and mixing time. Long horizons are reached
+//  by repeated squaring, P^(2^j), in
+//  O(K^3 log t) rather than t products.
+//
+//--------------------------------------------
+
+#ifndef ____Markov__
+#define ____Markov__
+
+#include <gsl/gsl_cblas.h>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// C = A B for K x K row-major stochastic matrices, with the rows of C
+// renormalised against rounding drift
+inline void markov_mult(const double* A, const double* B, double* C, int K) {
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, K, K, K, 1.0, A, K, B, K, 0.0, C, K);
+    for (int i=0; i<K; i++) {
+        double norm = 0;
+        for (int j=0; j<K; j++) {
+            norm += C[i*K+j];
+        }
+        for (int j=0; j<K; j++) {
+            C[i*K+j] /= norm;
+        }
+    }
+    return;
+}
+
+// Total variation distance between two distributions over K states
+inline double tv_distance(const double* p, const double* q, int K) {
+    double d = 0;
+    for (int i=0; i<K; i++) {
+        d += fabs(p[i] - q[i]);
+    }
+    return d / 2;
+}
+
+// Limit of start^T L^t as t -> infinity for the lazy chain L = (I + P)/2,
+// which has the stationary distributions of P but is aperiodic, so the limit
+// always exists. Stepped as w <- w L^(2^j), j = 0, 1, ..., from w = start
+// until a step moves w by less than tol in L1 (or after max_squarings). For an
+// irreducible P this is its stationary distribution whatever start; for a
+// reducible one each closed class gets the mass start eventually sends there.
+inline std::vector<double> markov_stationary(const double* P, const double* start, int K, double tol=1e-13, int max_squarings=64) {
+    std::vector<double> Q (K*K);
+    std::vector<double> tmp (K*K);
+    for (int i=0; i<K*K; i++) {
+        Q[i] = P[i] / 2;
+    }
+    for (int i=0; i<K; i++) {
+        Q[i*K+i] += 0.5;
+    }
+    std::vector<double> w (start, start+K);
+    std::vector<double> next (K);
+    for (int j=0; j<max_squarings; j++) {
+        cblas_dgemv(CblasRowMajor, CblasTrans, K, K, 1.0, Q.data(), K, w.data(), 1, 0.0, next.data(), 1);
+        double norm = 0;
+        for (int i=0; i<K; i++) {
+            norm += next[i];
+        }
+        double change = 0;
+        for (int i=0; i<K; i++) {
+            next[i] /= norm;
+            change += fabs(next[i] - w[i]);
+        }
+        w.swap(next);
+        if (change < tol) {
+            break;
+        }
+        markov_mult(Q.data(), Q.data(), tmp.data(), K);
+        Q.swap(tmp);
+    }
+    return w;
+}
+
+// Modulus of the second largest eigenvalue of P, |lambda_2|, as the spectral
+// radius of the deflated D = P - 1 pi^T (pi stationary): ||D^n||^(1/n) for
+// n = 2^j, squaring D with a running log scale until the estimate settles
+// to tol. Unlike power iteration on a vector this also converges for complex
+// or +-lambda pairs. 1 - |lambda_2| is the absolute spectral gap (0 for a
+// reducible or periodic chain).
+inline double markov_second_eigenvalue(const double* P, const double* pi, int K, double tol=1e-12, int max_squarings=60) {
+    std::vector<double> D (K*K);
+    std::vector<double> tmp (K*K);
+    for (int i=0; i<K; i++) {
+        for (int j=0; j<K; j++) {
+            D[i*K+j] = P[i*K+j] - pi[j];
+        }
+    }
+    auto rescale = [&]() {
+        // D /= max |D_ij|; returns log of the factor, or -inf once D vanishes
+        double s = 0;
+        for (int i=0; i<K*K; i++) {
+            s = std::max(s, fabs(D[i]));
+        }
+        if (s == 0) {
+            return -HUGE_VAL;
+        }
+        for (int i=0; i<K*K; i++) {
+            D[i] /= s;
+        }
+        return log(s);
+    };
+    double log_norm = rescale();        // log ||D^n||, n = 2^j
+    double lambda = exp(log_norm);
+    for (int j=1; j<=max_squarings && log_norm > -HUGE_VAL; j++) {
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, K, K, K, 1.0, D.data(), K, D.data(), K, 0.0, tmp.data(), K);
+        D.swap(tmp);
+        double log_s = rescale();
+        log_norm = (log_s > -HUGE_VAL) ? 2*log_norm + log_s : log_s;
+        double this_lambda = exp(ldexp(log_norm, -j));
+        if (fabs(this_lambda - lambda) < tol) {
+            return std::min(this_lambda, 1.0);
+        }
+        lambda = this_lambda;
+    }
+    return std::min(lambda, 1.0);
+}
+
+// Mixing time t_mix(eps) = min{t : max_i TV(P^t(i,.), pi) <= eps} for the
+// stationary distribution pi. P, P^2, P^4, ... bracket it, and the stored
+// powers then bisect the last interval, so it is exact and costs
+// O(K^3 log t_mix). Returns -1 if the chain has not mixed after
+// 2^max_squarings steps (reducible or periodic chains).
+inline long markov_mixing_time(const double* P, const double* pi, int K, double eps=0.25, int max_squarings=40) {
+    auto distance = [&](const double* M) {
+        double d = 0;
+        for (int i=0; i<K; i++) {
+            d = std::max(d, tv_distance(M + i*K, pi, K));
+        }
+        return d;
+    };
+    double d0 = 0;
+    for (int i=0; i<K; i++) {
+        d0 = std::max(d0, 1 - pi[i]);
+    }
+    if (d0 <= eps) {
+        return 0;
+    }
+    std::vector<std::vector<double> > powers (1, std::vector<double> (P, P+K*K));
+    if (distance(P) <= eps) {
+        return 1;
+    }
+    std::vector<double> Q (K*K);
+    while (true) {
+        if ((int) powers.size() > max_squarings) {
+            return -1;
+        }
+        markov_mult(powers.back().data(), powers.back().data(), Q.data(), K);
+        if (distance(Q.data()) <= eps) {
+            break;
+        }
+        powers.push_back(Q);
+    }
+    // d(2^j) > eps >= d(2^(j+1)), j = powers.size()-1; d(t) never increases
+    int j = powers.size() - 1;
+    std::vector<double> M = powers[j];
+    long t = 1L << j;
+    for (int i=j-1; i>=0; i--) {
+        markov_mult(M.data(), powers[i].data(), Q.data(), K);
+        if (distance(Q.data()) > eps) {
+            M = Q;
+            t += 1L << i;
+        }
+    }
+    return t + 1;
+}
+
+#endif /* defined(____Markov__) */
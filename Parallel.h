@@ -0,0 +1,47 @@
+//--------------------------------------------
+//  Parallel.h
+//
+//  Minimal std::thread helpers (no external
+//  threading library needed).
+//
+//--------------------------------------------
+
+#ifndef ____Parallel__
+#define ____Parallel__
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+// Number of worker threads to use when the caller does not specify one
+inline int default_nthreads() {
+    int n = std::thread::hardware_concurrency();
+    return (n > 0) ? n : 1;
+}
+
+// Calls f(i) for every i in [0,n) on up to nthreads threads (nthreads <= 0
+// means default_nthreads()). Work items are handed out one at a time from an
+// atomic counter, so uneven items balance out. f must be safe to call
+// concurrently for different i.
+template <class F>
+void parallel_for(int n, int nthreads, F f) {
+    if (nthreads <= 0) nthreads = default_nthreads();
+    if (nthreads > n) nthreads = n;
+    if (nthreads <= 1) {
+        for (int i=0; i<n; i++) f(i);
+        return;
+    }
+    std::atomic<int> next (0);
+    std::vector<std::thread> workers;
+    for (int k=0; k<nthreads; k++) {
+        workers.push_back(std::thread([&]() {
+            for (int i = next++; i < n; i = next++) f(i);
+        }));
+    }
+    for (int k=0; k<nthreads; k++) {
+        workers[k].join();
+    }
+    return;
+}
+
+#endif /* defined(____Parallel__) */
@@ -13,6 +13,7 @@
 #include <boost/foreach.hpp>
 
 #include <cfloat>
+#include <limits>
 #include <cmath>
 #include <cstdlib>
 #include <algorithm>
@@ -26,7 +27,7 @@ TreeBasin::TreeBasin(int N, int basin_num, RNG* rng) : BasinModel(N,basin_num,rn
     int nstats = (N%2==0) ? (N/2)*(N+1) : N*((N+1)/2);
     stats.assign(nstats, 0);
     for (int i=0; i<N; i++) {
-        double u = 0.1*((double) rand() / (double) RAND_MAX) + 0.45;
+        double u = 0.1*rng->uniform() + 0.45;
         stats[i] = u;
     }
     // stats N to N(N-1)/2 are <sigma_i sigma_j>; i<j
@@ -38,6 +39,7 @@ TreeBasin::TreeBasin(int N, int basin_num, RNG* rng) : BasinModel(N,basin_num,rn
             stats[N + ix + j] = stats[i]*stats[j];            
         }
     }
+    compile_tree();
     
     // Build graph
     BOOST_FOREACH (Vertex v, vertices(G))
@@ -87,10 +89,12 @@ void TreeBasin::doMLE(double alpha) {
         int j = min((int) u, (int) v);
         int ix = (i%2==0) ? (i/2)*(i-1) : i*((i-1)/2);
         double C = stats[N + ix + j];
-        if (C > stats[i]*stats[j] + alpha) {
-            G[e].negI = -compute_MI(C-alpha, stats[i], stats[j]);
-        } else if (C < stats[i]*stats[j] - alpha) {
-            G[e].negI = -compute_MI(C+alpha, stats[i], stats[j]);
+        double mi = stats[i];
+        double mj = stats[j];
+        if (C > mi*mj + alpha) {
+            G[e].negI = -compute_MI(C-alpha, mi, mj);
+        } else if (C < mi*mj - alpha) {
+            G[e].negI = -compute_MI(C+alpha, mi, mj);
         } else {
             G[e].negI = 0;
         }
@@ -116,10 +120,7 @@ void TreeBasin::doMLE(double alpha) {
     
     //cout << "Getting probabilities" << endl;
     // Associate appropriate conditional probabilities with each edge. Need a directionality on the tree, done by BFS.  Vertex 0 will be the root.
-    double thresh = 0.1;
-//    P0.clear();
     edge_list.clear();
-    below_thresh_list.clear();
 //    roots.clear();
     for (int i=0; i<N; i++) {
         adj_list[i].parent = -1;
@@ -133,8 +134,6 @@ void TreeBasin::doMLE(double alpha) {
   //      if (visited[this_root] == 0) {
             //cout << this_root << ", ";
 //            roots.push_back(this_root);
-//            P0.push_back(1);
-            P0 = 1;
 
             queue<int> to_process;
             to_process.push(0);
@@ -169,25 +168,8 @@ void TreeBasin::doMLE(double alpha) {
                         double p10 = (m1<1) ? (m2-C)/(1-m1) : 0;
                         double p00 = 1 - p10;
                         
-                        double r11=p11;
-                        double r01=p01;
-                        double r10=p10;
-                        double r00=p00;
-                        
-                        bool below_thresh = false;
-                        if (p00 > thresh) {
-                            r11 /= p00;
-                            r01 /= p00;
-                            r10 /= p00;
-                            P0 *= p00;
-                            r00 = 1;
-                        } else {
-                            below_thresh = true;
-                        }
-                        
-                        edge_list.push_back(TreeEdgeProb(p10,p11,p01,p00, r10,r11,r01,r00, curr_node, *it));
+                        edge_list.push_back(TreeEdgeProb(p10,p11,p01,p00, curr_node, *it));
                         int new_edge = edge_list.size() - 1;
-                        if (below_thresh) below_thresh_list.push_back(new_edge);
                         
                         adj_list[curr_node].children.push_back(new_edge);
                         adj_list[*it].parent = new_edge;
@@ -201,54 +183,86 @@ void TreeBasin::doMLE(double alpha) {
         
 //    }
     //cout << endl;
+    compile_tree();
     return;
 }
 
-double TreeBasin::P_state(const State& this_state) const {
-
+// Log of a probability, floored at the smallest normalized double so that
+// impossible configurations contribute a huge negative term instead of -inf
+// (and the differences below never become inf - inf = nan).
+static inline double floored_log(double p) {
+    return log(max(p, std::numeric_limits<double>::min()));
+}
 
-    if (edge_list.empty()) {
-        double P = 1;
-        for (int i=0; i<N; i++) {
-            P *= (this_state.word[i]==0) ? 1-stats[i] : stats[i];
-        }
-        return P;
+void TreeBasin::compile_tree() {
+    // Writes log P(sigma) relative to the all-silent word as a sum over the
+    // active neurons only:
+    //    log P(sigma) = log_P_silent + sum_{i on} ( log_child_off[i] + (sigma_parent(i) ? log_parent_on[i] : log_parent_off[i]) )
+    // with, for the edge (parent p -> child i) and L_i[a][b] = log P(sigma_i=a | sigma_p=b),
+    //    log_parent_off[i] = L_i[1][0] - L_i[0][0]     (i turns on, parent silent)
+    //    log_parent_on[i]  = L_i[1][1] - L_i[0][1]     (parent's children were counted as silent)
+    //    log_child_off[p]  = sum_{children c} L_c[0][1] - L_c[0][0]
+    // so below-threshold (p00 ~ 0) edges need no special treatment.
+    tree_parent.assign(N, -1);
+    log_child_off.assign(N, 0);
+    log_parent_off.assign(N, 0);
+    log_parent_on.assign(N, 0);
+    tree_order.clear();
+    tree_p_on.assign(2*N, 0);
+    
+    // Root (and, before the first doMLE, every neuron) is an independent Bernoulli
+    log_P_silent = 0;
+    int nroots = edge_list.empty() ? N : 1;
+    for (int i=0; i<nroots; i++) {
+        double m_i = stats[i];
+        log_P_silent += floored_log(1-m_i);
+        log_parent_off[i] = floored_log(m_i) - floored_log(1-m_i);
+        tree_order.push_back(i);
+        tree_p_on[2*i] = m_i;
     }
-
-    double P = P0;
-    // Factor due to root neuron
-//    for (int root_ix=0; root_ix < roots.size(); root_ix++) {
-//        P *= P0[root_ix];
-        P *= (this_state.word[0]==0) ? 1-stats[0] : stats[0];
-//    }
     
-    // Factor due to all edges with at least one spike.
-    for (vector<int>::const_iterator it=this_state.on_neurons.begin(); it!=this_state.on_neurons.end(); ++it) {
-        if (adj_list[*it].parent > -1) {  
-            TreeEdgeProb parent = edge_list[adj_list[*it].parent];
-            int sigma = this_state.word[parent.source];
-            P *= parent.factor[1][sigma];
-        }
-        for (vector<int>::const_iterator e = adj_list[*it].children.begin(); e!=adj_list[*it].children.end(); ++e) {
-            TreeEdgeProb child = edge_list[*e];
-            int sigma = this_state.word[child.target];
-            if (sigma==0) {          // Prevent double-counting 11 edges
-                P *= child.factor[0][1];
-            }
-        }
+    for (vector<TreeEdgeProb>::const_iterator it=edge_list.begin(); it!=edge_list.end(); ++it) {
+        int p = it->source;
+        int c = it->target;
+        double L00 = floored_log(it->cond_prob[0][0]);
+        double L01 = floored_log(it->cond_prob[0][1]);
+        double L10 = floored_log(it->cond_prob[1][0]);
+        double L11 = floored_log(it->cond_prob[1][1]);
+        tree_parent[c] = p;
+        log_P_silent += L00;
+        log_parent_off[c] = L10 - L00;
+        log_parent_on[c] = L11 - L01;
+        log_child_off[p] += L01 - L00;
+        // edge_list was filled breadth-first, so targets come out in topological order
+        tree_order.push_back(c);
+        tree_p_on[2*c] = it->cond_prob[1][0];
+        tree_p_on[2*c + 1] = it->cond_prob[1][1];
     }
+    return;
+}
 
-    // Factor due to below-threshold edges with no spikes
-    for (vector<int>::const_iterator e=below_thresh_list.begin(); e!=below_thresh_list.end(); ++e)
-    {
-        TreeEdgeProb edge = edge_list[*e];
-        if (this_state.word[edge.source] == 0 && this_state.word[edge.target]==0) {
-            P *= edge.factor[0][0];
-        }
-    }
+// Walks the active bits of the packed word (State::bits); the parent's state
+// is read from the same lanes.
+template <int W>
+double TreeBasin::P_state_lanes(const State& this_state) const {
     
-    
-    return P;
+    const word_lane* bits = this_state.bits.data();
+    double logP = log_P_silent;
+    for_each_on<W>(bits, this_state.bits.size(), [&](int n) {
+        int parent = tree_parent[n];
+        logP += log_child_off[n];
+        logP += (parent > -1 && word_bit(bits, parent)) ? log_parent_on[n] : log_parent_off[n];
+    });
+    return exp(logP);
+}
+
+double TreeBasin::P_state(const State& this_state) const {
+    switch (word_width) {
+        case 1: return P_state_lanes<1>(this_state);
+        case 2: return P_state_lanes<2>(this_state);
+        case 4: return P_state_lanes<4>(this_state);
+        default: return P_state_lanes<0>(this_state);
+    }
 }
 
 double TreeBasin::compute_MI(double Cij, double pi, double pj) {
@@ -268,32 +282,32 @@ double TreeBasin::compute_MI(double Cij, double pi, double pj) {
 
 vector<char> TreeBasin::sample() {
     vector<char> this_sample (N);
-    queue<int> to_process;
-    to_process.push(0);
-    this_sample[0] = (rng->bernoulli(stats[0])) ? 1 : 0;
-    while (!to_process.empty()) {
-        int curr_node = to_process.front();
-        char sigma = this_sample[curr_node];
-        for (vector<int>::const_iterator it=adj_list[curr_node].children.begin(); it!=adj_list[curr_node].children.end(); ++it) {
-            int next_node = edge_list[*it].target;
-            double p = edge_list[*it].cond_prob[1][sigma];
-            this_sample[next_node] = (rng->bernoulli(p)) ? 1 : 0;
-            to_process.push(next_node);
+    sample(1, this_sample.data(), *rng);
+    return this_sample;
+}
+
+void TreeBasin::sample(int nsamples, char* out, RNG& this_rng) const {
+    // Ancestral sampling along the precomputed topological order: every
+    // parent is drawn before its children, so no queue is needed.
+    for (int s=0; s<nsamples; s++) {
+        char* this_sample = out + (long) s*N;
+        for (vector<int>::const_iterator it=tree_order.begin(); it!=tree_order.end(); ++it) {
+            int parent = tree_parent[*it];
+            int sigma = (parent > -1) ? this_sample[parent] : 0;
+            this_sample[*it] = (this_rng.bernoulli(tree_p_on[2*(*it) + sigma])) ? 1 : 0;
         }
-        to_process.pop();
     }
-
-    return this_sample;
+    return;
 }
 
 paramsStruct TreeBasin::get_params() {
-    vector<double> vec_m (N);
+    vector<stat_t> vec_m (N);
     for (int i=0; i<N; i++) {
         vec_m[i] = stats[i];
     }
     m.assign(vec_m, N,1);
     
-    vector<double> vec_J (N*N, 0);
+    vector<stat_t> vec_J (N*N, 0);
     for (vector<TreeEdgeProb>::iterator it = edge_list.begin(); it!=edge_list.end(); ++it) {
         if (it->cond_prob[1][1] > 0 && it->cond_prob[0][0] > 0 && it->cond_prob[1][0] > 0 && it->cond_prob[0][1] > 0) {
             double this_J = log((it->cond_prob[1][1] * it->cond_prob[0][0]) / (it->cond_prob[1][0] * it->cond_prob[0][1]));
@@ -35,17 +35,10 @@ typedef boost::graph_traits<Graph>::vertex_descriptor       Vertex;
 typedef boost::graph_traits<Graph>::edge_descriptor         Edge;
 
 struct TreeEdgeProb {
-    TreeEdgeProb(double p10, double p11, double p01, double p00,
-                 double r10, double r11, double r01, double r00, int u, int v) :
-    source(u), target(v) {cond_prob[0][0]=p00; cond_prob[0][1]=p01; cond_prob[1][0]=p10; cond_prob[1][1]=p11; factor[0][0]=r00; factor[0][1]=r01; factor[1][0]=r10; factor[1][1]=r11;};
+    TreeEdgeProb(double p10, double p11, double p01, double p00, int u, int v) :
+    source(u), target(v) {cond_prob[0][0]=p00; cond_prob[0][1]=p01; cond_prob[1][0]=p10; cond_prob[1][1]=p11;};
     
-//    double r10;         // store P(1|0)/P(0|0)
-//    double r11;         //  and  P(1|1)/P(0|0)
-//    double r01;
-//    double r00;
-
-    double cond_prob[2][2]; // P(1|0), P(1|1)
-    double factor[2][2];
+    double cond_prob[2][2]; // cond_prob[a][b] = P(target=a | source=b)
     int source;
     int target;
 };
@@ -65,23 +58,32 @@ public:
     void doMLE(double);
     double P_state(const State&) const;
     vector<char> sample();
+    void sample(int, char*, RNG&) const;    // nsamples x N words, row-major, into a preallocated buffer
     
     paramsStruct get_params();
 private:
-//    vector<double> P0;
-    double P0;
     double alpha;       // regularization parameter
     
     vector<TreeNode> adj_list;
     vector<TreeEdgeProb> edge_list;
-    vector<int> below_thresh_list;
-    myMatrix<double> J;
-    myMatrix<double> m;
+    myMatrix<stat_t> J;
+    myMatrix<stat_t> m;
 //    vector<int> roots;
 
+    // Flattened tree used by P_state, rebuilt by compile_tree() (see TreeBasin.cpp)
+    vector<int> tree_parent;        // Parent neuron of each node; -1 for the root
+    vector<double> log_child_off;
+    vector<double> log_parent_off;
+    vector<double> log_parent_on;
+    double log_P_silent;
+    vector<int> tree_order;         // Neurons in topological (BFS) order, root first
+    vector<double> tree_p_on;       // P(sigma_i=1 | sigma_parent(i)=b) at [2*i + b]
+
     Graph G;
     
     double compute_MI(double,double,double);
+    void compile_tree();
+    template <int W> double P_state_lanes(const State&) const;
 };
 
 
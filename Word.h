@@ -0,0 +1,129 @@
+//--------------------------------------------
+//  Word.h
+//
+//  Bit-packed binary words: a word of N
+//  neurons is stored in 64-bit lanes, so
+//  per-neuron loops only visit the active
+//  bits (popcount / count-trailing-zeros).
+//
+//--------------------------------------------
+
+#ifndef ____Word__
+#define ____Word__
+
+#include <vector>
+#include <stdint.h>
+
+typedef uint64_t word_lane;
+const int word_lane_bits = 64;
+
+inline int word_nlanes(int N) {
+    return (N + word_lane_bits - 1) / word_lane_bits;
+}
+
+// Lane count the word kernels are specialised for: exactly 1, 2 or 4 lanes
+// (N <= 64, 65..128 or 193..256), or 0 for the generic kernel that reads the
+// lane count at run time. The width must equal the packed lane count, since
+// the kernels read W lanes of every word (3 lanes use the generic kernel).
+inline int word_kernel_width(int N) {
+    int nlanes = word_nlanes(N);
+    if (nlanes <= 1) return 1;
+    if (nlanes == 2) return 2;
+    if (nlanes == 4) return 4;
+    return 0;
+}
+
+// Packs a 0/1 char word into lanes; bit n of the word is bit (n%64) of lane n/64.
+// Unused high bits of the last lane are zero.
+inline void pack_word(const std::vector<char>& word, std::vector<word_lane>& bits) {
+    int N = word.size();
+    bits.assign(word_nlanes(N), 0);
+    for (int n=0; n<N; n++) {
+        if (word[n]) {
+            bits[n / word_lane_bits] |= ((word_lane) 1) << (n % word_lane_bits);
+        }
+    }
+    return;
+}
+
+inline int word_bit(const word_lane* bits, int n) {
+    return (int) ((bits[n / word_lane_bits] >> (n % word_lane_bits)) & 1);
+}
+
+inline void set_word_bit(std::vector<word_lane>& bits, int n) {
+    bits[n / word_lane_bits] |= ((word_lane) 1) << (n % word_lane_bits);
+    return;
+}
+
+inline int lane_popcount(word_lane x) {
+    return __builtin_popcountll(x);
+}
+
+inline int lane_ctz(word_lane x) {
+    return __builtin_ctzll(x);
+}
+
+// Packed word used as the key of the state tables (all keys of a table have
+// the same lane count). WordLess orders keys like the '0'/'1' strings of the
+// same words, neuron 0 first, so tables keep their iteration order.
+typedef std::vector<word_lane> word_key;
+
+struct WordLess
+{
+    bool operator() (const word_key& a, const word_key& b) const {
+        for (size_t l=0; l<a.size(); l++) {
+            word_lane diff = a[l] ^ b[l];
+            if (diff) {
+                // The lowest differing bit is the first neuron where they differ
+                return (b[l] >> lane_ctz(diff)) & 1;
+            }
+        }
+        return false;
+    }
+};
+
+// W is the number of lanes, fixed at compile time so the lane loop unrolls;
+// W = 0 is the fallback for any N, with the lane count passed in nlanes.
+template <int W>
+inline int word_popcount(const word_lane* bits, int nlanes) {
+    const int L = (W > 0) ? W : nlanes;
+    int count = 0;
+    for (int l=0; l<L; l++) {
+        count += lane_popcount(bits[l]);
+    }
+    return count;
+}
+
+// Calls f(n) for every active neuron n, in increasing order.
+template <int W, class F>
+inline void for_each_on(const word_lane* bits, int nlanes, F f) {
+    const int L = (W > 0) ? W : nlanes;
+    for (int l=0; l<L; l++) {
+        word_lane x = bits[l];
+        while (x) {
+            f(l*word_lane_bits + lane_ctz(x));
+            x &= x - 1;
+        }
+    }
+    return;
+}
+
+// Calls f(n, code) for every neuron n active in prev or in curr, with
+// code = curr_n + 2*prev_n (1: turned on, 2: turned off, 3: stayed on).
+// Neurons silent in both words (code 0) are skipped.
+template <int W, class F>
+inline void for_each_flip(const word_lane* prev, const word_lane* curr, int nlanes, F f) {
+    const int L = (W > 0) ? W : nlanes;
+    for (int l=0; l<L; l++) {
+        word_lane x = prev[l] | curr[l];
+        while (x) {
+            int b = lane_ctz(x);
+            int code = (int) ((curr[l] >> b) & 1) + 2 * (int) ((prev[l] >> b) & 1);
+            f(l*word_lane_bits + b, code);
+            x &= x - 1;
+        }
+    }
+    return;
+}
+
+#endif /* defined(____Word__) */
@@ -0,0 +1,118 @@
+//--------------------------------------------
+//  WordCache.h
+//
+//  Bounded LRU cache of per-word mode
+//  posteriors, keyed by packed words (Word.h)
+//  and tied to a model version, so repeated
+//  words are scored once per model.
+//
+//--------------------------------------------
+
+#ifndef ____WordCache__
+#define ____WordCache__
+
+#include "Word.h"
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <cstddef>
+
+// Posterior over modes of one word under a mixture: P[i] = w_i P(word | i) / Z
+struct WordPosterior
+{
+    std::vector<double> P;
+    double Z;
+    int mode;               // argmax_i P[i]
+};
+
+struct WordHash
+{
+    size_t operator() (const std::vector<word_lane>& bits) const {
+        // 64-bit mix of the lanes (splitmix64 finaliser per lane)
+        unsigned long long h = bits.size();
+        for (size_t l=0; l<bits.size(); l++) {
+            unsigned long long z = h ^ (bits[l] + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2));
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            h = z ^ (z >> 31);
+        }
+        return (size_t) h;
+    }
+};
+
+class WordCache
+{
+public:
+    WordCache(size_t capacity=16384) : capacity (capacity), version (0), nhits (0), nmisses (0) {};
+
+    // Empties the cache unless it already holds posteriors of this model:
+    // the version counter and the mixture weights it was filled with
+    void sync(unsigned long model_version, const std::vector<double>& w) {
+        if (model_version != version || w != weights) {
+            clear();
+            version = model_version;
+            weights = w;
+        }
+        return;
+    }
+
+    // Cached posterior of the packed word, or NULL; a hit becomes the most recent entry
+    const WordPosterior* find(const std::vector<word_lane>& bits) {
+        index_map::iterator it = index.find(bits);
+        if (it == index.end()) {
+            nmisses++;
+            return NULL;
+        }
+        nhits++;
+        entries.splice(entries.begin(), entries, it->second);
+        return &(it->second->second);
+    }
+
+    // Stores the posterior of a word not in the cache, evicting the least
+    // recently used entry when full (nothing is kept with capacity 0)
+    void insert(const std::vector<word_lane>& bits, const WordPosterior& value) {
+        if (capacity == 0) {
+            return;
+        }
+        if (index.size() >= capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.push_front(std::make_pair(bits, value));
+        index[bits] = entries.begin();
+        return;
+    }
+
+    void set_capacity(size_t n) {
+        capacity = n;
+        while (index.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return;
+    }
+
+    void clear() {
+        entries.clear();
+        index.clear();
+        return;
+    }
+
+    size_t size() const {return index.size();};
+    size_t hits() const {return nhits;};
+    size_t misses() const {return nmisses;};
+private:
+    typedef std::list<std::pair<std::vector<word_lane>, WordPosterior> > entry_list;   // Most recent first
+    typedef std::unordered_map<std::vector<word_lane>, entry_list::iterator, WordHash> index_map;
+
+    entry_list entries;
+    index_map index;
+    size_t capacity;
+    unsigned long version;
+    std::vector<double> weights;
+    size_t nhits, nmisses;
+};
+
+#endif /* defined(____WordCache__) */
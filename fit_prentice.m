@@ -14,8 +14,8 @@ niter = 100;
 
 spikeRaster = retinaData.bint;
 
-% compile with #define matlabHMM in EMBasins.cpp and set below matlabHMM = 1
-% if commented there, then model doesn't use temporal correlations, set matlabHMM = 0
+% matlabHMM = 1 fits the HMM ('hmm'), matlabHMM = 0 the model without
+% temporal correlations ('mixture'); no recompiling needed
 matlabHMM = 1
 
 if matlabHMM == 0 % without temporal correlations
@@ -56,7 +56,7 @@ if matlabHMM == 0 % without temporal correlations
     %spikeRaster = spikeRaster[:,shuffled_idxs]
 
     [Pw, params, samples, P_emp, condP, P_model, LL_train, LL_test] = ...
-        EMBasins(nrnSpikeTimes, nrnSpikeTimesTest, binsize, nbasins, niter);
+        EMBasins(nrnSpikeTimes, nrnSpikeTimesTest, binsize, nbasins, niter, 'mixture');
 
 else % with temporal correlations
 
@@ -102,7 +102,7 @@ else % with temporal correlations
         [params,trans,P,emiss_prob,alpha,pred_prob,hist,sample,...
             stationary_prob,train_logli(:,k),test_logli(:,k)] = ...
                 EMBasins(nrnSpikeTimes(goodcells), [unobserved_low', unobserved_hi'], ...
-                    binsize, nbasins, niter); %#ok
+                    binsize, nbasins, niter, 'hmm'); %#ok
         end %for
         
         % -- Save: --
@@ -124,7 +124,7 @@ else % with temporal correlations
         
         [params,trans,P,emiss_prob,alpha,pred_prob,hist,sample,...
             stationary_prob,train_logli,test_logli] = ...
-                EMBasins(nrnSpikeTimes(goodcells), [], binsize, nbasins, niter); 
+                EMBasins(nrnSpikeTimes(goodcells), [], binsize, nbasins, niter, 'hmm'); 
         
         % -- Save: --
         Output.train_logli= train_logli;
@@ -1,3 +1,22 @@
 import EMBasins
 
-print('EMBasin is imported')
\ No newline at end of file
+print('EMBasin is imported')
+
+import numpy as np
+
+EMBasins.pyInit()
+
+# Autocorr on 150 neurons: words of three 64-bit lanes, which take the
+# generic packed-word kernel (the 1, 2 and 4 lane kernels must not read
+# past the third lane)
+rng = np.random.RandomState(0)
+N, nbins = 150, 3000
+nrnspiketimes = [sorted(np.flatnonzero(rng.rand(nbins) < rate).tolist()) for rate in rng.uniform(0.005, 0.05, N)]
+logli, alpha, params, forward, backward, basin_trans, w, P_indep = \
+    EMBasins.pyAutocorr(nrnspiketimes, 1.0, 3, 22, model='independent')
+assert np.all(np.isfinite(logli))
+assert basin_trans.shape == (3, 4*N)
+codes = basin_trans.reshape(3, N, 4)
+assert np.all((codes >= 0) & (codes <= 1))
+assert np.allclose(codes[:, :, 0] + codes[:, :, 1], 1) and np.allclose(codes[:, :, 2] + codes[:, :, 3], 1)
+print('Autocorr with N=150 ok')